@@ -1,39 +1,37 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
-#include <assert.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if !defined(ASM_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(ASM_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "lc3.h"
 
-#define MEM_MAKE(mem, type)                                         \
-do {                                                                \
-    (mem)->size = 0;                                                \
-    (mem)->cap = 8;                                                 \
-    if (((mem)->buf = malloc((mem)->cap * sizeof(type))) == NULL) { \
-        perror("malloc");                                           \
-        exit(1);                                                    \
-    }                                                               \
-} while (0)
-
-#define MEM_GROW(mem, type)                                          \
-do {                                                                 \
-    if ((mem)->size == (mem)->cap) {                                 \
-        (mem)->cap *= 2;                                             \
-        (mem)->buf = realloc((mem)->buf, (mem)->cap * sizeof(type)); \
-        if ((mem)->buf == NULL) {                                    \
-            perror("realloc");                                       \
-            exit(1);                                                 \
-        }                                                            \
-    }                                                                \
-} while (0)
-
-#define MEM_FREE(mem) free((mem)->buf)
+// @NOTE(art): one assembly. Errors go to `diags`; fatal ones (out of memory,
+// line longer than the window, read error) also jump back to the entry
+// point through `fail`, which frees whatever was allocated.
+struct env {
+    struct lc3_allocator alloc;
+    struct lc3_diag *diags;
+    jmp_buf fail;
+};
 
 enum token_kind {
     T_ERR,
     T_COMMA,
     T_NEWLINE,
+    T_EOF,
 
     T_LABEL,
     T_IDENT,
@@ -54,6 +52,8 @@ enum token_kind {
     T_FILL,
     T_BLKW,
     T_STRINGZ,
+    T_GLOBAL,
+    T_EXTERNAL,
 
     T_BR,
     T_LD,
@@ -93,145 +93,413 @@ enum token_kind {
     T_STRING
 };
 
+#define SOURCE_CAP (64 << 10)
+
+// @NOTE(art): character class scans used by the scanner, 32 (AVX2) or 16
+// (SSE2) bytes at a time, plain loop for the tail and without SIMD
+// (or with ASM_SCALAR). All of them return first byte in [p, end) that does
+// not belong to the run, or end.
+#if !defined(ASM_SCALAR) && defined(__AVX2__)
+#define VEC_SIZE 32
+#define VEC_ALL 0xFFFFFFFFu
+typedef __m256i vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *) (p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_add(a, b) _mm256_add_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(v) ((uint32_t) _mm256_movemask_epi8(v))
+#elif !defined(ASM_SCALAR) && defined(__SSE2__)
+#define VEC_SIZE 16
+#define VEC_ALL 0xFFFFu
+typedef __m128i vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *) (p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_add(a, b) _mm_add_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(v) ((uint32_t) _mm_movemask_epi8(v))
+#endif
+
+#ifdef VEC_SIZE
+// @NOTE(art): lo <= c <= hi with signed compares only, c - lo is shifted so
+// that the range starts at -128
+static inline vec vec_in_range(vec v, char lo, char hi)
+{
+    vec shifted = vec_add(v, vec_set1((char) (0x80 - lo)));
+    return vec_gt(vec_set1((char) (-128 + (hi - lo) + 1)), shifted);
+}
+#endif
+
+static inline int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static char *span_blanks(char *p, char *end)
+{
+#ifdef VEC_SIZE
+    vec space = vec_set1(' '), tab = vec_set1('\t'), cr = vec_set1('\r');
+    for (; end - p >= VEC_SIZE; p += VEC_SIZE) {
+        vec v = vec_load(p);
+        uint32_t m = vec_mask(vec_or(vec_or(vec_eq(v, space), vec_eq(v, tab)),
+                    vec_eq(v, cr)));
+        if (m != VEC_ALL) return p + __builtin_ctz(~m);
+    }
+#endif
+    while (p < end && is_blank(*p)) p++;
+    return p;
+}
+
+// @NOTE(art): [0-9A-Za-z], same as isalnum() in C locale
+static char *span_alnum(char *p, char *end)
+{
+#ifdef VEC_SIZE
+    vec lower = vec_set1(0x20);
+    for (; end - p >= VEC_SIZE; p += VEC_SIZE) {
+        vec v = vec_load(p);
+        vec digit = vec_in_range(v, '0', '9');
+        vec alpha = vec_in_range(vec_or(v, lower), 'a', 'z');
+        uint32_t m = vec_mask(vec_or(digit, alpha));
+        if (m != VEC_ALL) return p + __builtin_ctz(~m);
+    }
+#endif
+    while (p < end && isalnum((unsigned char) *p)) p++;
+    return p;
+}
+
+// @NOTE(art): everything up to `c`, for comments and strings
+static char *span_until(char *p, char *end, char c)
+{
+#ifdef VEC_SIZE
+    vec needle = vec_set1(c);
+    for (; end - p >= VEC_SIZE; p += VEC_SIZE) {
+        uint32_t m = vec_mask(vec_eq(vec_load(p), needle));
+        if (m != 0) return p + __builtin_ctz(m);
+    }
+#endif
+    while (p < end && *p != c) p++;
+    return p;
+}
+
+// @NOTE(art): source is read from `fd` (or copied from `src` when fd is -1)
+// through a fixed window. On refill everything from the first token of the
+// current line on is moved to the front, so tokens of the line being parsed
+// stay valid; `moved` tells the compiler how far to rebase them. buf[end] is
+// always '\0'.
 struct scanner {
+    struct env *env;
+    int fd;
+    const char *src;
+    size_t src_left;
     char *start;
     char *curr;
+    char *end;
+    char *line_start;
+    size_t moved;
     size_t line;
     int add_newline;
+    int is_done;
+    int is_eof;
+    char buf[SOURCE_CAP + sizeof(uint64_t)];
 };
 
+// @NOTE(art): lexem points into the scanner window (or at a literal for
+// newline and end of file). Refill moves the window, tokens of the current
+// line are rebased by `moved` (see rebase_tokens()) and older ones are not,
+// so lexem is only good until the scanner is past the token's line.
 struct token {
-    enum token_kind kind;
     char *lexem;
-    size_t len;
-    size_t line;
+    uint32_t line;
+    u16 len;
     u16 lit;
+    unsigned char kind;
 };
 
-struct tokens_array {
+#define STRINGS_CAP (4 << 10)
+
+// @NOTE(art): label names, they have to outlive the scanner window. Names
+// are referred to by offset, so the buffer is free to move when it grows.
+struct strings {
+    size_t size;
+    size_t cap;
+    char *buf;
+};
+
+// @NOTE(art): labels are struct of arrays indexed by label id. Ids never
+// change, the open addressing table (linear probing, power of two, at most
+// 3/4 full) only maps names to them. Label used before its definition gets
+// an id straight away, with is_defined unset until definition shows up.
+struct labels {
+    size_t size;
+    size_t cap;
+    uint32_t *name;
+    uint32_t *hash;
+    u16 *len;
+    u16 *addr;
+    unsigned char *is_defined;
+    unsigned char *scope;
+
+    size_t slots_cap;
+    uint32_t *slots;
+};
+
+// @NOTE(art): object as it is built, origin word first
+struct image {
+    size_t size;
+    size_t cap;
+    u16 *buf;
+};
+
+// @NOTE(art): address of every emitted line, goes to out.sym for profiler
+struct lines {
     size_t size;
     size_t cap;
-    struct token *buf;
+    u16 *addr;
+    unsigned *nr;
 };
 
-struct label {
-    char *name;
-    size_t len;
-    size_t offset;
+// @NOTE(art): label used before its definition. Word at image[at] gets its
+// address patched by resolve_fixups(), `kind` is lc3_reloc_kind.
+struct fixups {
+    size_t size;
+    size_t cap;
+    uint32_t *at;
+    uint32_t *label;
+    uint32_t *line;
+    unsigned char *kind;
 };
 
-struct labels_array {
+struct relocs {
     size_t size;
     size_t cap;
-    struct label *buf;
+    struct lc3_reloc *buf;
 };
 
+// @NOTE(art): tokens are scanned on demand into a small ring, one
+// instruction never holds more than a handful of them at once
+#define TOKENS_RING 16
+
 struct compiler {
-    struct tokens_array *tokens;
-    size_t start_addr;
-    size_t addr_offset;
+    struct env *env;
+    struct scanner *scanner;
+    struct token ring[TOKENS_RING];
     size_t curr;
+    size_t start_addr;
+    int is_absolute;
+    struct image image;
+    struct strings strings;
+    struct labels labels;
+    struct fixups fixups;
+    struct relocs relocs;
+    struct lines lines;
+};
+
+// @NOTE(art): everything one assembly allocates up front, in one piece
+struct state {
+    struct env env;
+    struct compiler compiler;
+    struct scanner scanner;
 };
 
-char *read_file(char *path)
+static void *libc_realloc(void *ctx, void *ptr, size_t size)
 {
-    size_t fsize;
-    char *src;
-    FILE *f ;
+    (void) ctx;
+    return realloc(ptr, size);
+}
 
-    if ((f = fopen(path, "r")) == NULL) {
-        perror("fopen");
-        exit(1);
-    }
+static void libc_free(void *ctx, void *ptr)
+{
+    (void) ctx;
+    free(ptr);
+}
 
-    if (fseek(f, 0, SEEK_END) < 0) {
-        perror("fseek");
-        exit(1);
+static void report(struct env *env, size_t line, char *at, size_t len,
+        const char *msg)
+{
+    struct lc3_diag *d = env->diags;
+    if (d->count < LC3_DIAG_CAP) {
+        struct lc3_diag_entry *e = d->buf + d->count;
+        if (len > LC3_DIAG_AT_CAP - 1) len = LC3_DIAG_AT_CAP - 1;
+        e->line = line;
+        memcpy(e->at, at, len);
+        e->at[len] = '\0';
+        e->msg = msg;
     }
+    d->count++;
+}
 
-    if ((int) (fsize = ftell(f)) < 0) {
-        perror("ftell");
-        exit(1);
-    }
+static void fatal(struct env *env, size_t line, const char *msg)
+{
+    report(env, line, "", 0, msg);
+    longjmp(env->fail, 1);
+}
 
-    rewind(f);
+// @NOTE(art): realloc for one array of a struct of arrays
+static void *grow(struct env *env, void *buf, size_t cap, size_t item_size)
+{
+    buf = env->alloc.realloc(env->alloc.ctx, buf, cap * item_size);
+    if (buf == NULL) fatal(env, 0, "out of memory");
+    return buf;
+}
+
+static void release(struct env *env, void *buf)
+{
+    if (buf != NULL) env->alloc.free(env->alloc.ctx, buf);
+}
 
-    if ((src = calloc(fsize + 1, sizeof(char))) == NULL) {
-        perror("calloc");
-        exit(1);
+static uint32_t intern(struct env *env, struct strings *ss, char *str,
+        size_t len)
+{
+    if (ss->size + len > ss->cap) {
+        ss->cap = ss->cap ? ss->cap : STRINGS_CAP;
+        while (ss->size + len > ss->cap) ss->cap *= 2;
+        ss->buf = grow(env, ss->buf, ss->cap, sizeof(char));
     }
 
-    if (fread(src, sizeof(char), fsize, f) < fsize) {
-        perror("fread");
-        exit(1);
+    uint32_t offset = ss->size;
+    memcpy(ss->buf + offset, str, len);
+    ss->size += len;
+    return offset;
+}
+
+// @NOTE(art): returns number of bytes read, 0 at the end of input
+static size_t refill(struct scanner *s)
+{
+    if (s->is_eof) return 0;
+
+    char *keep = s->add_newline ? s->line_start : s->start;
+    size_t delta = keep - s->buf;
+    if (delta > 0) {
+        memmove(s->buf, keep, s->end - keep);
+        s->start -= delta;
+        s->curr -= delta;
+        s->end -= delta;
+        s->line_start -= delta;
+        s->moved += delta;
     }
 
-    if (fclose(f) < 0) {
-        perror("fclose");
-        exit(1);
+    size_t room = s->buf + SOURCE_CAP - s->end;
+    if (room == 0) fatal(s->env, s->line, "line is longer than 64K");
+
+    ssize_t n;
+    if (s->fd < 0) {
+        n = room < s->src_left ? room : s->src_left;
+        memcpy(s->end, s->src, n);
+        s->src += n;
+        s->src_left -= n;
+    } else {
+        do {
+            n = read(s->fd, s->end, room);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) fatal(s->env, s->line, "read error");
     }
+    if (n == 0) s->is_eof = 1;
+
+    s->end += n;
+    *s->end = '\0';
 
-    return src;
+    return n;
 }
 
-int has_chars(struct scanner *s)
+static int has_chars(struct scanner *s)
 {
-    return *s->curr != '\0';
+    return s->curr < s->end || refill(s) > 0;
 }
 
-char advance(struct scanner *s)
+static char peek(struct scanner *s)
 {
-    return *s->curr++;
+    if (s->curr == s->end) refill(s);
+    return *s->curr;
 }
 
-char peek(struct scanner *s)
+static char advance(struct scanner *s)
 {
-    return *s->curr;
+    char c = peek(s);
+    if (s->curr < s->end) s->curr++;
+    return c;
 }
 
-int next(struct scanner *s, char c)
+static int next(struct scanner *s, char c)
 {
     if (!has_chars(s)) return 0;
     return peek(s) == c;
 }
 
-int is_instruction(enum token_kind kind)
+// @NOTE(art): moves curr over a run of alnum chars, refilling as needed
+static void scan_alnum(struct scanner *s)
+{
+    while ((s->curr = span_alnum(s->curr, s->end)) == s->end && refill(s));
+}
+
+// @NOTE(art): moves curr up to `c` or end of input. With `is_skip` bytes
+// passed are not part of any token, so the window does not keep them.
+static void scan_until(struct scanner *s, char c, int is_skip)
+{
+    for (;;) {
+        s->curr = span_until(s->curr, s->end, c);
+        if (is_skip) s->start = s->curr;
+        if (s->curr < s->end || !refill(s)) return;
+    }
+}
+
+// @NOTE(art): source is not lowercased as a whole, only identifiers and
+// directives are, in place, once they are scanned
+static void fold_case(char *p, char *end)
+{
+    for (; p < end; p++) {
+        if (*p >= 'A' && *p <= 'Z') *p |= 0x20;
+    }
+}
+
+static int is_instruction(enum token_kind kind)
 {
     return kind > T_instruction_begin && kind < T_instruction_end;
 }
 
-int is_reg(enum token_kind kind)
+static int is_reg(enum token_kind kind)
 {
     return kind > T_reg_begin && kind < T_reg_end;
 }
 
-int is_num(enum token_kind kind)
+static int is_num(enum token_kind kind)
 {
     return kind == T_DECIMAL || kind == T_HEX;
 }
 
-void make_token(struct scanner *s, struct token *t, enum token_kind kind)
+// @NOTE(art): scanner only lets digits of the base through, value wraps to
+// 16 bits like the word it ends up in
+static u16 parse_num(char *p, char *end, unsigned base)
+{
+    int is_neg = p < end && *p == '-';
+    u16 value = 0;
+    for (p += is_neg; p < end; p++) {
+        unsigned digit = isdigit((unsigned char) *p) ? *p - '0'
+            : (*p | 0x20) - 'a' + 10;
+        value = value * base + digit;
+    }
+    return is_neg ? -value : value;
+}
+
+static void make_token(struct scanner *s, struct token *t, enum token_kind kind)
 {
+    if (!s->add_newline) s->line_start = s->start;
+
     t->kind = kind;
     t->lexem = s->start;
     t->len = s->curr - s->start;
     t->line = s->line;
 
     if (is_num(kind)) {
-        int base = 10;
-        if (kind == T_HEX) {
-            base = 16;
-        }
-        // @NOTE(art): enough for 16bit int
-        char buf[6] = {0};
-        strncpy(buf, t->lexem + 1, t->len - 1);
-        t->lit = strtol(buf, NULL, base);
+        t->lit = parse_num(t->lexem + 1, s->curr, kind == T_HEX ? 16 : 10);
     }
 
     s->add_newline = 1;
 }
 
-void make_newline_token(struct scanner *s, struct token *t)
+static void make_newline_token(struct scanner *s, struct token *t)
 {
     t->kind = T_NEWLINE;
     t->lexem = "\\n";
@@ -241,72 +509,212 @@ void make_newline_token(struct scanner *s, struct token *t)
     s->add_newline = 0;
 }
 
-void tokens_put(struct tokens_array *ts, enum token_kind kind,
-        struct scanner *s)
+static void make_eof_token(struct scanner *s, struct token *t)
 {
-    MEM_GROW(ts, struct token);
-
-    struct token *t = ts->buf + ts->size;
-    if (kind == T_NEWLINE) {
-        make_newline_token(s, t);
-    } else {
-        make_token(s, t, kind);
-    }
-    ts->size++;
+    t->kind = T_EOF;
+    t->lexem = "end of file";
+    t->len = 11;
+    t->line = s->line;
 }
 
-void skip_whitespace(struct scanner *s, struct tokens_array *ts)
+// @NOTE(art): returns 1 when it stopped at the end of a line that had tokens
+static int skip_whitespace(struct scanner *s, struct token *t)
 {
     for (;;) {
+        s->start = s->curr = span_blanks(s->curr, s->end);
+
         switch (peek(s)) {
         case ' ':
         case '\t':
         case '\r':
-            advance(s);
             break;
 
         case '\n':
-            s->line++;
             if (s->add_newline) {
-                tokens_put(ts, T_NEWLINE, s);
+                make_newline_token(s, t);
+                s->line++;
+                advance(s);
+                return 1;
             }
+            s->line++;
             advance(s);
+            s->start = s->curr;
+            break;
+
+        default: return 0;
+        }
+    }
+}
+
+struct keyword {
+    uint64_t key;
+    enum token_kind kind;
+};
+
+#include "keywords.h"
+
+// @NOTE(art): registers, mnemonics, trap aliases and directives (with the
+// dot) are in one perfect hash table made by kwgen.c, see keywords.h.
+// T_IDENT when it is not one of them.
+static enum token_kind keyword_kind(char *start, size_t len)
+{
+    if (len > sizeof(uint64_t)) return T_IDENT;
+
+    // @NOTE(art): window has 8 bytes of slack, so this never reads past it
+    uint64_t key;
+    memcpy(&key, start, sizeof(key));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    key = __builtin_bswap64(key);
+#endif
+    if (len < sizeof(key)) key &= (1ull << (len * 8)) - 1;
+
+    const struct keyword *k =
+        keywords + (key * KEYWORDS_MULT >> (64 - KEYWORDS_BITS));
+    return k->key == key ? k->kind : T_IDENT;
+}
+
+// @NOTE(art): next token of the source. Line with tokens always ends with
+// T_NEWLINE, even the last one, then T_EOF forever (also after .end).
+static void scan_token(struct scanner *s, struct token *t)
+{
+    for (;;) {
+        s->start = s->curr;
+        if (skip_whitespace(s, t)) return;
+
+        if (!has_chars(s) || s->is_done) {
+            if (s->add_newline) {
+                make_newline_token(s, t);
+            } else {
+                make_eof_token(s, t);
+            }
+            return;
+        }
+
+        s->start = s->curr;
+        char c = advance(s);
+
+        // @NOTE(art): kwds, regs, labels
+        if (c != 'x' && c != 'X' && isalpha((unsigned char) c)) {
+            scan_alnum(s);
+            fold_case(s->start, s->curr);
+
+            enum token_kind kind = keyword_kind(s->start, s->curr - s->start);
+            if (kind == T_IDENT && !s->add_newline) kind = T_LABEL;
+
+            make_token(s, t, kind);
+            return;
+        }
+
+        switch (c) {
+        case ';':
+            scan_until(s, '\n', 1);
             break;
 
-        default: return;
+        case ',':
+            make_token(s, t, T_COMMA);
+            return;
+
+        case '"':
+            scan_until(s, '"', 0);
+            advance(s);
+            make_token(s, t, T_STRING);
+            return;
+
+        case '#':
+            if (next(s, '-')) advance(s);
+            while (isdigit(peek(s))) advance(s);
+
+            make_token(s, t, T_DECIMAL);
+            return;
+
+        case 'x':
+        case 'X':
+            if (next(s, '-')) advance(s);
+            while (isxdigit(peek(s))) advance(s);
+
+            make_token(s, t, T_HEX);
+            return;
+
+        case '.': {
+            scan_alnum(s);
+            fold_case(s->start, s->curr);
+
+            size_t len = s->curr - s->start;
+            enum token_kind kind = keyword_kind(s->start, len);
+
+            // @NOTE(art): only directive longer than 8 byte keyword keys
+            if (len == 9 && memcmp(s->start, ".external", len) == 0) {
+                kind = T_EXTERNAL;
+            }
+
+            if (kind == T_IDENT) kind = T_ERR;
+            if (kind == T_EOF) {
+                s->is_done = 1;
+                break;
+            }
+
+            if (kind == T_ERR) {
+                report(s->env, s->line, s->start, s->curr - s->start,
+                        "unknown directive");
+                break;
+            }
+            make_token(s, t, kind);
+            return;
+        }
+
+        default:
+            report(s->env, s->line, s->start, 1, "unexpected character");
         }
     }
 }
 
-int has_tokens(struct compiler *c)
+static int has_tokens(struct compiler *c)
 {
-    return c->curr < c->tokens->size;
+    return c->ring[c->curr % TOKENS_RING].kind != T_EOF;
 }
 
-struct token *peek_token(struct compiler *c)
+static struct token *peek_token(struct compiler *c)
 {
-    return c->tokens->buf + c->curr;
+    return c->ring + c->curr % TOKENS_RING;
 }
 
-struct token *advance_token(struct compiler *c)
+// @NOTE(art): tokens of lines already parsed are dead and left alone
+static void rebase_tokens(struct compiler *c)
+{
+    struct scanner *s = c->scanner;
+    for (size_t i = 0; i < TOKENS_RING; ++i) {
+        struct token *t = c->ring + i;
+        if (t->lexem >= s->buf + s->moved &&
+                t->lexem <= s->buf + SOURCE_CAP) {
+            t->lexem -= s->moved;
+        }
+    }
+    s->moved = 0;
+}
+
+static struct token *advance_token(struct compiler *c)
 {
     struct token *t = peek_token(c);
-    if (has_tokens(c)) c->curr++;
+    if (has_tokens(c)) {
+        c->curr++;
+        scan_token(c->scanner, peek_token(c));
+        if (c->scanner->moved) rebase_tokens(c);
+    }
     return t;
 }
 
-void report_compiler_error(struct token *t, char *msg)
+static void report_compiler_error(struct compiler *c, struct token *t,
+        const char *msg)
 {
-    fprintf(stderr, "[line %lu] at %.*s: %s\n",
-            t->line, t->len, t->lexem, msg);
+    report(c->env, t->line, t->lexem, t->len, msg);
 }
 
-void sync_compiler(struct compiler *c)
+static void sync_compiler(struct compiler *c)
 {
     while (has_tokens(c) && advance_token(c)->kind != T_NEWLINE);
 }
 
-enum lc3_reg get_reg(enum token_kind kind)
+static enum lc3_reg get_reg(enum token_kind kind)
 {
     switch (kind) {
     case T_R0: return R_R0;
@@ -320,7 +728,7 @@ enum lc3_reg get_reg(enum token_kind kind)
     }
 }
 
-enum lc3_opcode get_opcode(enum token_kind kind)
+static enum lc3_opcode get_opcode(enum token_kind kind)
 {
     switch (kind) {
     case T_BR:
@@ -358,446 +766,438 @@ enum lc3_opcode get_opcode(enum token_kind kind)
     }
 }
 
-struct label *get_label(struct labels_array *ls, struct token *t)
+// @NOTE(art): FNV-1a
+static uint32_t hash_label(char *name, size_t len)
 {
-    struct label *found = NULL;
-    for (size_t i = 0; i < ls->size; ++i) {
-        struct label *l = ls->buf + i;
-        if (l->len == t->len && memcmp(l->name, t->lexem, t->len) == 0) {
-            found = l;
-            break;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void labels_slots(struct env *env, struct labels *ls, size_t cap)
+{
+    ls->slots_cap = cap;
+    ls->slots = grow(env, NULL, cap, sizeof(uint32_t));
+    memset(ls->slots, 0, cap * sizeof(uint32_t));
+}
+
+// @NOTE(art): slot holding id + 1 of the label, or empty slot where it goes
+static uint32_t *labels_slot(struct compiler *c, char *name, size_t len,
+        uint32_t hash)
+{
+    struct labels *ls = &c->labels;
+    size_t mask = ls->slots_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = ls->slots + i;
+        if (*slot == 0) return slot;
+
+        uint32_t id = *slot - 1;
+        if (ls->hash[id] == hash && ls->len[id] == len &&
+                memcmp(c->strings.buf + ls->name[id], name, len) == 0) {
+            return slot;
         }
     }
-    return found;
 }
 
-struct token *consume(struct compiler *c, enum token_kind kind, char *msg)
+static void labels_grow(struct env *env, struct labels *ls)
+{
+    if (ls->size == ls->cap) {
+        ls->cap = ls->cap ? ls->cap * 2 : 64;
+        ls->name = grow(env, ls->name, ls->cap, sizeof(*ls->name));
+        ls->hash = grow(env, ls->hash, ls->cap, sizeof(*ls->hash));
+        ls->len = grow(env, ls->len, ls->cap, sizeof(*ls->len));
+        ls->addr = grow(env, ls->addr, ls->cap, sizeof(*ls->addr));
+        ls->is_defined = grow(env, ls->is_defined, ls->cap,
+                sizeof(*ls->is_defined));
+        ls->scope = grow(env, ls->scope, ls->cap, sizeof(*ls->scope));
+    }
+
+    if ((ls->size + 1) * 4 <= ls->slots_cap * 3) return;
+
+    // @NOTE(art): ids stay, only slots are rebuilt
+    uint32_t *old = ls->slots;
+    ls->slots = NULL;
+    release(env, old);
+    labels_slots(env, ls, ls->slots_cap * 2);
+
+    size_t mask = ls->slots_cap - 1;
+    for (size_t id = 0; id < ls->size; ++id) {
+        size_t i = ls->hash[id] & mask;
+        while (ls->slots[i] != 0) i = (i + 1) & mask;
+        ls->slots[i] = id + 1;
+    }
+}
+
+// @NOTE(art): id of the label named by token, new undefined one if there is
+// no such label yet
+static uint32_t labels_id(struct compiler *c, struct token *t)
+{
+    struct labels *ls = &c->labels;
+    uint32_t hash = hash_label(t->lexem, t->len);
+    uint32_t *slot = labels_slot(c, t->lexem, t->len, hash);
+    if (*slot != 0) return *slot - 1;
+
+    labels_grow(c->env, ls);
+    slot = labels_slot(c, t->lexem, t->len, hash);
+
+    uint32_t id = ls->size++;
+    ls->name[id] = intern(c->env, &c->strings, t->lexem, t->len);
+    ls->hash[id] = hash;
+    ls->len[id] = t->len;
+    ls->addr[id] = 0;
+    ls->is_defined[id] = 0;
+    ls->scope[id] = LC3_LOCAL;
+    *slot = id + 1;
+    return id;
+}
+
+// @NOTE(art): returns 0 if label is already defined (or external)
+static int labels_define(struct compiler *c, struct token *t, size_t addr)
+{
+    struct labels *ls = &c->labels;
+    uint32_t id = labels_id(c, t);
+    if (ls->is_defined[id] || ls->scope[id] == LC3_EXTERNAL) return 0;
+
+    ls->addr[id] = addr;
+    ls->is_defined[id] = 1;
+    return 1;
+}
+
+static struct token *consume(struct compiler *c, enum token_kind kind,
+        const char *msg)
 {
     struct token *t = advance_token(c);
     if (t->kind != kind) {
-        report_compiler_error(t, msg);
+        report_compiler_error(c, t, msg);
         sync_compiler(c);
         return NULL;
     }
     return t;
 }
 
-struct token *consume_reg(struct compiler *c)
+static struct token *consume_reg(struct compiler *c)
 {
     struct token *t = advance_token(c);
     if (!is_reg(t->kind)) {
-        report_compiler_error(t, "expected register");
+        report_compiler_error(c, t, "expected register");
         sync_compiler(c);
         return NULL;
     }
     return t;
 }
 
-struct token *consume_num(struct compiler *c)
+static struct token *consume_num(struct compiler *c)
 {
     struct token *t = advance_token(c);
     if (!is_num(t->kind)) {
-        report_compiler_error(t, "expected number");
+        report_compiler_error(c, t, "expected number");
         sync_compiler(c);
         return NULL;
     }
     return t;
 }
 
-struct token *consume_reg_or_num(struct compiler *c)
+static struct token *consume_reg_or_num(struct compiler *c)
 {
     struct token *t = advance_token(c);
     if (!is_reg(t->kind) && !is_num(t->kind)) {
-        report_compiler_error(t, "expected register or number");
+        report_compiler_error(c, t, "expected register or number");
         sync_compiler(c);
         return NULL;
     }
     return t;
 }
 
-struct token *consume_comma(struct compiler *c)
+static struct token *consume_comma(struct compiler *c)
 {
     struct token *t = advance_token(c);
     if (t->kind != T_COMMA) {
-        report_compiler_error(t, "expected comma");
+        report_compiler_error(c, t, "expected comma");
         sync_compiler(c);
         return NULL;
     }
     return t;
 }
 
-struct label *consume_label(struct compiler *c, struct labels_array *ls)
-{
-    struct token *ident = consume(c, T_IDENT, "expected label");
-    if (!ident) return NULL;
 
-    struct label *found = get_label(ls, ident);
-    if (!found) {
-        report_compiler_error(ident, "label does not exist");
-        sync_compiler(c);
-        return NULL;
+static void emit_fill(struct compiler *c, u16 word, size_t count)
+{
+    struct image *img = &c->image;
+    if (img->size + count > img->cap) {
+        img->cap = img->cap ? img->cap : 64;
+        while (img->size + count > img->cap) img->cap *= 2;
+        img->buf = grow(c->env, img->buf, img->cap, sizeof(u16));
     }
-    return found;
+
+    for (size_t i = 0; i < count; ++i) img->buf[img->size + i] = word;
+    img->size += count;
 }
 
-size_t calc_offset(struct compiler *c, struct label *ident)
+static void emit(struct compiler *c, u16 word)
 {
-    size_t label_addr = c->start_addr + ident->offset;
-    size_t curr_addr = c->start_addr + c->addr_offset + 1;
-    return label_addr - curr_addr;
+    emit_fill(c, word, 1);
 }
 
-int main(void)
+// @NOTE(art): address of the next emitted word, image starts with origin
+static size_t curr_addr(struct compiler *c)
 {
-    // @TODO(art): get filepath from args
-    // @LEAK(art): let OS free it
-    char *src = read_file("./ex.asm");
+    return c->start_addr + c->image.size - 1;
+}
 
-    for (char *p = src; *p; p++) *p = tolower(*p);
+static size_t calc_offset(size_t addr, u16 label_addr)
+{
+    return label_addr - (addr + 1);
+}
 
-    struct scanner s = {
-        .start = src,
-        .curr = src,
-        .line = 1,
-        .add_newline = 0
+static void add_reloc(struct compiler *c, size_t at, uint32_t id,
+        unsigned char kind)
+{
+    struct relocs *rs = &c->relocs;
+    if (rs->size == rs->cap) {
+        rs->cap = rs->cap ? rs->cap * 2 : 64;
+        rs->buf = grow(c->env, rs->buf, rs->cap, sizeof(*rs->buf));
+    }
+    rs->buf[rs->size++] = (struct lc3_reloc) {
+        .at = at,
+        .label = id,
+        .kind = kind
     };
+}
 
-    // @LEAK(art): let OS free it
-    struct tokens_array tokens;
-    MEM_MAKE(&tokens, struct token);
-
-    int stop_scanning = 0;
-
-    for (;;) {
-        skip_whitespace(&s, &tokens);
-        if (!has_chars(&s) || stop_scanning) break;
+// @NOTE(art): fills address of label `id` into image[at]. Externals are left
+// to the linker, and so are absolute addresses in relocatable module.
+static void patch(struct compiler *c, size_t at, uint32_t id,
+        unsigned char kind)
+{
+    struct labels *ls = &c->labels;
+    u16 *word = c->image.buf + at;
 
-        s.start = s.curr;
-        char c = advance(&s);
+    if (ls->scope[id] == LC3_EXTERNAL) {
+        add_reloc(c, at, id, kind);
+        return;
+    }
 
-        // @NOTE(art): kwds, regs, labels
-        if (c != 'x' && isalpha(c)) {
-            while (isalnum(peek(&s))) advance(&s);
-
-            enum token_kind kind = T_IDENT;
-
-            switch (s.curr - s.start) {
-            case 2:
-                switch (*s.start) {
-                case 'r':
-                    switch (*(s.start + 1)) {
-                    case '0': kind = T_R0; break;
-                    case '1': kind = T_R1; break;
-                    case '2': kind = T_R2; break;
-                    case '3': kind = T_R3; break;
-                    case '4': kind = T_R4; break;
-                    case '5': kind = T_R5; break;
-                    case '6': kind = T_R6; break;
-                    case '7': kind = T_R7; break;
-                    }
-                    break;
-                case 'b':
-                    if (*(s.start + 1) == 'r') kind = T_BR;
-                    break;
-                case 'i':
-                    if (*(s.start + 1) == 'n') kind = T_IN;
-                    break;
-                case 'l':
-                    if (*(s.start + 1) == 'd') kind = T_LD;
-                    break;
-                case 's':
-                    if (*(s.start + 1) == 't') kind = T_ST;
-                    break;
-                }
-                break;
+    size_t addr = c->start_addr + at - 1;
+    switch (kind) {
+    case LC3_RELOC_PC9:
+        *word |= calc_offset(addr, ls->addr[id]) & 0x1FF;
+        break;
+    case LC3_RELOC_PC11:
+        *word |= calc_offset(addr, ls->addr[id]) & 0x7FF;
+        break;
+    case LC3_RELOC_ABS16:
+        *word = ls->addr[id];
+        if (!c->is_absolute) add_reloc(c, at, id, kind);
+        break;
+    }
+}
 
-            case 3:
-                switch (*s.start) {
-                case 'a':
-                    if (memcmp(s.start + 1, "dd", 2) == 0) {
-                        kind = T_ADD;
-                    } else if (memcmp(s.start + 1, "nd", 2) == 0) {
-                        kind = T_AND;
-                    }
-                    break;
-                case 'b':
-                    if (memcmp(s.start + 1, "rn", 2) == 0) {
-                        kind = T_BRN;
-                    } else if (memcmp(s.start + 1, "rz", 2) == 0) {
-                        kind = T_BRZ;
-                    } else if (memcmp(s.start + 1, "rp", 2) == 0) {
-                        kind = T_BRP;
-                    }
-                    break;
-                case 'j':
-                    if (memcmp(s.start + 1, "mp", 2) == 0) {
-                        kind = T_JMP;
-                    } else if (memcmp(s.start + 1, "sr", 2) == 0) {
-                        kind = T_JSR;
-                    }
-                    break;
-                case 'l':
-                    if (memcmp(s.start + 1, "di", 2) == 0) {
-                        kind = T_LDI;
-                    } else if (memcmp(s.start + 1, "dr", 2) == 0) {
-                        kind = T_LDR;
-                    } else if (memcmp(s.start + 1, "ea", 2) == 0) {
-                        kind = T_LEA;
-                    }
-                    break;
-                case 'n':
-                    if (memcmp(s.start + 1, "ot", 2) == 0) kind = T_NOT;
-                    break;
-                case 'r':
-                    if (memcmp(s.start + 1, "et", 2) == 0) {
-                        kind = T_RET;
-                    } else if (memcmp(s.start + 1, "ti", 2) == 0) {
-                        kind = T_RTI;
-                    }
-                    break;
-                case 's':
-                    if (memcmp(s.start + 1, "ti", 2) == 0) {
-                        kind = T_STI;
-                    } else if (memcmp(s.start + 1, "tr", 2) == 0) {
-                        kind = T_STR;
-                    }
-                    break;
-                case 'o':
-                    if (memcmp(s.start + 1, "ut", 2) == 0) kind = T_OUT;
-                    break;
-                }
-                break;
+// @NOTE(art): emits `word` and fills label operand into it. Label that is
+// not defined yet gets a fixup.
+static int emit_label(struct compiler *c, u16 word, unsigned char kind)
+{
+    struct token *ident = consume(c, T_IDENT, "expected label");
+    if (!ident) return 0;
 
-            case 4:
-                switch (*s.start) {
-                case 'b':
-                    if (memcmp(s.start + 1, "rnz", 3) == 0) {
-                        kind = T_BRNZ;
-                    } else if (memcmp(s.start + 1, "rnp", 3) == 0) {
-                        kind = T_BRNP;
-                    } else if (memcmp(s.start + 1, "rzp", 3) == 0) {
-                        kind = T_BRZP;
-                    }
-                    break;
-                case 'j':
-                    if (memcmp(s.start + 1, "srr", 3) == 0) kind = T_JSRR;
-                    break;
-                case 't':
-                    if (memcmp(s.start + 1, "rap", 3) == 0) kind = T_TRAP;
-                    break;
-                case 'h':
-                    if (memcmp(s.start + 1, "alt", 3) == 0) kind = T_HALT;
-                    break;
-                case 'g':
-                    if (memcmp(s.start + 1, "etc", 3) == 0) kind = T_GETC;
-                    break;
-                case 'p':
-                    if (memcmp(s.start + 1, "uts", 3) == 0) kind = T_PUTS;
-                    break;
-                }
-                break;
+    emit(c, word);
 
-            case 5:
-                switch (*s.start) {
-                case 'b':
-                    if (memcmp(s.start + 1, "rnzp", 4) == 0) kind = T_BRNZP;
-                    break;
-                }
-                break;
-            }
+    struct labels *ls = &c->labels;
+    uint32_t id = labels_id(c, ident);
+    if (ls->is_defined[id]) {
+        patch(c, c->image.size - 1, id, kind);
+        return 1;
+    }
 
-            if (kind == T_IDENT) {
-                if (tokens.size == 0 ||
-                        tokens.buf[tokens.size - 1].kind == T_NEWLINE) {
-                    kind = T_LABEL;
-                }
-            }
+    struct fixups *fs = &c->fixups;
+    if (fs->size == fs->cap) {
+        fs->cap = fs->cap ? fs->cap * 2 : 64;
+        fs->at = grow(c->env, fs->at, fs->cap, sizeof(*fs->at));
+        fs->label = grow(c->env, fs->label, fs->cap, sizeof(*fs->label));
+        fs->line = grow(c->env, fs->line, fs->cap, sizeof(*fs->line));
+        fs->kind = grow(c->env, fs->kind, fs->cap, sizeof(*fs->kind));
+    }
+    fs->at[fs->size] = c->image.size - 1;
+    fs->label[fs->size] = id;
+    fs->line[fs->size] = ident->line;
+    fs->kind[fs->size] = kind;
+    fs->size++;
+    return 1;
+}
 
-            tokens_put(&tokens, kind, &s);
+static void resolve_fixups(struct compiler *c)
+{
+    struct labels *ls = &c->labels;
+    struct fixups *fs = &c->fixups;
+
+    for (size_t i = 0; i < fs->size; ++i) {
+        uint32_t id = fs->label[i];
+        if (!ls->is_defined[id] && ls->scope[id] != LC3_EXTERNAL) {
+            struct token t = {
+                .lexem = c->strings.buf + ls->name[id],
+                .line = fs->line[i],
+                .len = ls->len[id],
+                .kind = T_IDENT
+            };
+            report_compiler_error(c, &t, "label does not exist");
             continue;
         }
 
-        switch (c) {
-        case ';':
-            while (!next(&s, '\n')) advance(&s);
-            break;
-
-        case ',':
-            tokens_put(&tokens, T_COMMA, &s);
-            break;
-
-        case '"':
-            advance(&s);
-            while (!next(&s, '"')) advance(&s);
-            advance(&s);
-            tokens_put(&tokens, T_STRING, &s);
-            break;
-
-        case '#':
-            if (next(&s, '-')) advance(&s);
-            while (isdigit(peek(&s))) advance(&s);
-
-            tokens_put(&tokens, T_DECIMAL, &s);
-            break;
-
-        case 'x':
-            if (next(&s, '-')) advance(&s);
-            while (isxdigit(peek(&s))) advance(&s);
-
-            tokens_put(&tokens, T_HEX, &s);
-            break;
-
-        case '.':
-            while (isalnum(peek(&s))) advance(&s);
-
-            enum token_kind kind = T_ERR;
-
-            switch (s.curr - s.start) {
-            case 4:
-                if (memcmp(s.start + 1, "end", 3) == 0) {
-                    stop_scanning = 1;
-                    continue;
-                }
-                break;
-            case 5:
-                if (memcmp(s.start + 1, "orig", 4) == 0) {
-                    kind = T_ORIG;
-                } else if (memcmp(s.start + 1, "fill", 4) == 0) {
-                    kind = T_FILL;
-                } else if (memcmp(s.start + 1, "blkw", 4) == 0) {
-                    kind = T_BLKW;
-                }
-                break;
-            case 8:
-                if (memcmp(s.start + 1, "stringz", 7) == 0) kind = T_STRINGZ;
-                break;
-            }
-
-            // @TODO(art): handle error
-            assert(kind != T_ERR);
-            tokens_put(&tokens, kind, &s);
-            break;
+        patch(c, fs->at[i], id, fs->kind[i]);
+    }
 
-        default: printf("Unknown char: '%c'\n", c);
+    for (uint32_t id = 0; id < ls->size; ++id) {
+        if (ls->scope[id] == LC3_GLOBAL && !ls->is_defined[id]) {
+            report(c->env, 0, c->strings.buf + ls->name[id], ls->len[id],
+                    "global label is not defined");
         }
     }
+}
 
-    // @TODO(art): -1 to ignore .orig directive, we assume it always present.
-    // Make it so it does not matter if directive was used, as default address
-    // for user programs is 0x3000.
-    int addr_offset = -1;
+// @NOTE(art): .global and .external take one label each
+static void declare_label(struct compiler *c, unsigned char scope)
+{
+    struct token *ident = consume(c, T_IDENT, "expected label");
+    if (!ident) return;
 
-    // @LEAK(art): let OS free it
-    struct labels_array labels;
-    MEM_MAKE(&labels, struct label);
+    struct labels *ls = &c->labels;
+    uint32_t id = labels_id(c, ident);
+    if (ls->scope[id] != LC3_LOCAL && ls->scope[id] != scope) {
+        report_compiler_error(c, ident, "label is both global and external");
+    }
+    if (scope == LC3_EXTERNAL && ls->is_defined[id]) {
+        report_compiler_error(c, ident, "label already defined");
+    }
+    ls->scope[id] = scope;
+}
 
-    for (size_t i = 0; i < tokens.size; ++i) {
-        struct token *t = tokens.buf + i;
+static void add_line(struct compiler *c, size_t nr)
+{
+    struct lines *ls = &c->lines;
+    if (ls->size == ls->cap) {
+        ls->cap = ls->cap ? ls->cap * 2 : 64;
+        ls->addr = grow(c->env, ls->addr, ls->cap, sizeof(*ls->addr));
+        ls->nr = grow(c->env, ls->nr, ls->cap, sizeof(*ls->nr));
+    }
+    ls->addr[ls->size] = curr_addr(c);
+    ls->nr[ls->size] = nr;
+    ls->size++;
+}
 
-        switch (t->kind) {
-        case T_NEWLINE:
-            addr_offset += 1;
-            break;
+// @NOTE(art): line by line until end of input. Error skips the rest of its
+// line and assembly goes on, so one run reports as many as it can.
+static void compile(struct compiler *c)
+{
+    scan_token(c->scanner, peek_token(c));
 
-        case T_LABEL:;
-            MEM_GROW(&labels, struct label);
-            labels.buf[labels.size++] = (struct label) {
-                .name = t->lexem,
-                .len = t->len,
-                .offset = (size_t) addr_offset
-            };
-            break;
+    while (has_tokens(c)) {
+        struct token *t = peek_token(c);
+        if (t->kind == T_NEWLINE) {
+            advance_token(c);
+            continue;
         }
-    }
-
-    struct compiler c = {
-        .tokens = &tokens,
-        .start_addr = 0x3000,
-        .addr_offset = 0,
-        .curr = 0
-    };
 
-    FILE *out = fopen("out.obj", "wb");
-    // @TODO(art): handle error
-    assert(out != NULL);
+        // @NOTE(art): user programs start at x3000 when there is no .orig,
+        // .global and .external may come before it
+        if (t->kind != T_ORIG && t->kind != T_GLOBAL &&
+                t->kind != T_EXTERNAL && c->image.size == 0) {
+            emit(c, c->start_addr);
+        }
 
-    while (has_tokens(&c)) {
-        if (peek_token(&c)->kind == T_LABEL) {
-            advance_token(&c);
+        if (t->kind == T_LABEL) {
+            if (!labels_define(c, t, curr_addr(c))) {
+                report_compiler_error(c, t, "label already defined");
+            }
+            advance_token(c);
         }
 
-        struct token *opcode = advance_token(&c);
+        struct token *opcode = advance_token(c);
         if (opcode->kind == T_NEWLINE) continue;
         if (!is_instruction(opcode->kind)) {
-            report_compiler_error(opcode, "unknown instruction");
-            sync_compiler(&c);
+            report_compiler_error(c, opcode, "unknown instruction");
+            sync_compiler(c);
             continue;
         }
 
+        if (opcode->kind != T_ORIG && opcode->kind != T_GLOBAL &&
+                opcode->kind != T_EXTERNAL) {
+            add_line(c, opcode->line);
+        }
+
         switch (opcode->kind) {
         case T_ORIG: {
-            if (c.curr > 1) {
-                report_compiler_error(opcode, "must be top level");
-                sync_compiler(&c);
+            if (c->image.size > 0) {
+                report_compiler_error(c, opcode, "must be top level");
+                sync_compiler(c);
                 continue;
             }
-            struct token *addr = consume_num(&c);
+            struct token *addr = consume_num(c);
             if (!addr) continue;
-            c.start_addr = addr->lit;
-            c.addr_offset -= 1;
-            fwrite(&addr->lit, sizeof(u16), 1, out);
+            c->start_addr = addr->lit;
+            c->is_absolute = 1;
+            emit(c, addr->lit);
         } break;
 
+        case T_GLOBAL:
+            declare_label(c, LC3_GLOBAL);
+            break;
+
+        case T_EXTERNAL:
+            declare_label(c, LC3_EXTERNAL);
+            break;
+
         case T_FILL: {
-            struct token *value = consume_num(&c);
+            if (peek_token(c)->kind == T_IDENT) {
+                if (!emit_label(c, 0, LC3_RELOC_ABS16)) continue;
+                break;
+            }
+            struct token *value = consume_num(c);
             if (!value) continue;
-            fwrite(&value->lit, sizeof(u16), 1, out);
+            emit(c, value->lit);
         } break;
 
         case T_BLKW: {
-            struct token *value = consume_num(&c);
+            struct token *value = consume_num(c);
             if (!value) continue;
 
-            u16 zero = 0;
-            for (size_t i = 0; i < value->lit; ++i) {
-                fwrite(&zero, sizeof(zero), 1, out);
-            }
+            emit_fill(c, 0, value->lit);
         } break;
 
         case T_STRINGZ: {
-            struct token *str = consume(&c, T_STRING, "expected string");
+            struct token *str = consume(c, T_STRING, "expected string");
             if (!str) continue;
 
-            for (size_t i = 1; i < str->len - 1; ++i) {
-                u16 c = str->lexem[i];
-                if (c == '\\' && i + 1 < str->len) {
+            for (size_t i = 1; i + 1 < str->len; ++i) {
+                u16 ch = str->lexem[i];
+                if (ch == '\\' && i + 1 < str->len) {
                     switch (str->lexem[i + 1]) {
-                    case 'a': c = 0x7; i++; break;
-                    case 'b': c = 0x8; i++; break;
-                    case 't': c = 0x9; i++; break;
-                    case 'n': c = 0xA; i++; break;
-                    case 'v': c = 0xB; i++; break;
-                    case 'f': c = 0xC; i++; break;
-                    case 'r': c = 0xD; i++; break;
+                    case 'a': ch = 0x7; i++; break;
+                    case 'b': ch = 0x8; i++; break;
+                    case 't': ch = 0x9; i++; break;
+                    case 'n': ch = 0xA; i++; break;
+                    case 'v': ch = 0xB; i++; break;
+                    case 'f': ch = 0xC; i++; break;
+                    case 'r': ch = 0xD; i++; break;
                     }
                 }
-                fwrite(&c, sizeof(c), 1, out);
+                emit(c, ch);
             }
-            u16 null = '\0';
-            fwrite(&null, sizeof(null), 1, out);
+            emit(c, '\0');
         } break;
 
         case T_ADD:
         case T_AND: {
             struct token *dst, *src1, *src2;
 
-            if (!(dst = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(dst = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
-            if (!(src1 = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(src1 = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
-            if (!(src2 = consume_reg_or_num(&c))) continue;
+            if (!(src2 = consume_reg_or_num(c))) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(dst->kind) << 9;
@@ -810,7 +1210,7 @@ int main(void)
                 op |= src2->lit & 0x1F;
             }
 
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_BRNZP:
@@ -821,10 +1221,7 @@ int main(void)
         case T_BRZ:
         case T_BRP:
         case T_BR: {
-            struct label *ident = consume_label(&c, &labels);
-            if (!ident) continue;
-
-            unsigned nzp;
+            unsigned nzp = 0x7;
             switch (opcode->kind) {
             case T_BRNZP: nzp = 0x7; break;
             case T_BRNZ: nzp = 0x6; break;
@@ -838,42 +1235,37 @@ int main(void)
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= nzp << 9;
-            op |= calc_offset(&c, ident) & 0x1FF;
-            fwrite(&op, sizeof(op), 1, out);
+            if (!emit_label(c, op, LC3_RELOC_PC9)) continue;
         } break;
 
         case T_JMP: {
-            struct token *base = consume_reg(&c);
+            struct token *base = consume_reg(c);
             if (!base) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(base->kind) << 6;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_RET: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x7 << 6;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_JSR: {
-            struct label *ident = consume_label(&c, &labels);
-            if (!ident) continue;
-
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 1 << 11;
-            op |= calc_offset(&c, ident) & 0x7FF;
-            fwrite(&op, sizeof(op), 1, out);
+            if (!emit_label(c, op, LC3_RELOC_PC11)) continue;
         } break;
 
         case T_JSRR: {
-            struct token *base = consume_reg(&c);
+            struct token *base = consume_reg(c);
             if (!base) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(base->kind) << 6;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_LD:
@@ -881,127 +1273,381 @@ int main(void)
         case T_LDI:
         case T_STI: {
             struct token *reg;
-            struct label *ident;
 
-            if (!(reg = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
-
-            if (!(ident = consume_label(&c, &labels))) continue;
+            if (!(reg = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(reg->kind) << 9;
-            op |= calc_offset(&c, ident) & 0x1FF;
-            fwrite(&op, sizeof(op), 1, out);
+            if (!emit_label(c, op, LC3_RELOC_PC9)) continue;
         } break;
 
         case T_LDR:
         case T_STR: {
             struct token *reg, *base, *offset;
 
-            if (!(reg = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(reg = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
-            if (!(base = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(base = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
-            if (!(offset = consume_num(&c))) continue;
+            if (!(offset = consume_num(c))) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(reg->kind) << 9;
             op |= get_reg(base->kind) << 6;
             op |= offset->lit & 0x3F;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_LEA: {
             struct token *dst;
-            struct label *ident;
-
-            if (!(dst = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
 
-            if (!(ident = consume_label(&c, &labels))) continue;
+            if (!(dst = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(dst->kind) << 9;
-            op |= calc_offset(&c, ident) & 0x1FF;
-            fwrite(&op, sizeof(op), 1, out);
+            if (!emit_label(c, op, LC3_RELOC_PC9)) continue;
         } break;
 
         case T_NOT: {
             struct token *dst, *src;
 
-            if (!(dst = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(dst = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
-            if (!(src = consume_reg(&c))) continue;
-            if (!consume_comma(&c)) continue;
+            if (!(src = consume_reg(c))) continue;
+            if (!consume_comma(c)) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= get_reg(dst->kind) << 9;
             op |= get_reg(src->kind) << 6;
             op |= 0x3F;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_RTI: {
             u16 op = get_opcode(opcode->kind) << 12;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_TRAP: {
-            struct token *trapvec = consume_num(&c);
+            struct token *trapvec = consume_num(c);
             if (!trapvec) continue;
 
             u16 op = get_opcode(opcode->kind) << 12;
             op |= trapvec->lit & 0xFF;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_IN: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x23;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_OUT: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x21;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_GETC: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x20;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_PUTS: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x22;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_HALT: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x25;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
 
         case T_PUTSP: {
             u16 op = get_opcode(opcode->kind) << 12;
             op |= 0x24;
-            fwrite(&op, sizeof(op), 1, out);
+            emit(c, op);
         } break;
         }
 
-        if (!consume(&c, T_NEWLINE, "expected new line after instruction"))
-            continue;
+        consume(c, T_NEWLINE, "expected new line after instruction");
+    }
+
+    resolve_fixups(c);
+}
+
+// @NOTE(art): hands image, names and lines over to `out`, what is left is
+// freed by free_state()
+static void finish(struct compiler *c, struct lc3_image *out)
+{
+    struct labels *ls = &c->labels;
+
+    // @NOTE(art): without errors every label is defined or external, so
+    // label ids (which relocations use) are indices into out->labels
+    out->labels = grow(c->env, NULL, ls->size ? ls->size : 1,
+            sizeof(struct lc3_label));
+    for (size_t id = 0; id < ls->size; ++id) {
+        out->labels[id] = (struct lc3_label) {
+            .name = c->strings.buf + ls->name[id],
+            .len = ls->len[id],
+            .addr = ls->addr[id],
+            .scope = ls->scope[id]
+        };
+    }
+    out->labels_size = ls->size;
+
+    out->words = c->image.buf;
+    out->size = c->image.size;
+    out->is_absolute = c->is_absolute;
+    out->names = c->strings.buf;
+    out->relocs = c->relocs.buf;
+    out->relocs_size = c->relocs.size;
+    out->line_addr = c->lines.addr;
+    out->line_nr = c->lines.nr;
+    out->lines_size = c->lines.size;
+
+    c->image.buf = NULL;
+    c->strings.buf = NULL;
+    c->relocs.buf = NULL;
+    c->lines.addr = NULL;
+    c->lines.nr = NULL;
+}
+
+struct lc3_allocator lc3_image_allocator(struct lc3_image *img)
+{
+    if (img->alloc.realloc != NULL) return img->alloc;
+    return (struct lc3_allocator) {
+        .realloc = libc_realloc,
+        .free = libc_free,
+        .ctx = NULL
+    };
+}
+
+static struct state *make_state(struct lc3_image *out, struct lc3_diag *diags,
+        int fd, const char *src, size_t len)
+{
+    struct lc3_allocator alloc = lc3_image_allocator(out);
+    struct lc3_allocator keep = out->alloc;
+    memset(out, 0, sizeof(*out));
+    out->alloc = keep;
+    diags->count = 0;
+
+    struct state *st = alloc.realloc(alloc.ctx, NULL, sizeof(*st));
+    if (st == NULL) {
+        struct env env = {.alloc = alloc, .diags = diags};
+        report(&env, 0, "", 0, "out of memory");
+        return NULL;
+    }
+
+    // @NOTE(art): scanner window is left as is, only the header is zeroed
+    memset(st, 0, offsetof(struct state, scanner.buf));
+    st->env.alloc = alloc;
+    st->env.diags = diags;
+
+    struct compiler *c = &st->compiler;
+    c->env = &st->env;
+    c->scanner = &st->scanner;
+    c->start_addr = 0x3000;
+
+    struct scanner *s = &st->scanner;
+    s->env = &st->env;
+    s->fd = fd;
+    s->src = src;
+    s->src_left = len;
+    s->start = s->curr = s->end = s->line_start = s->buf;
+    s->line = 1;
+    s->buf[0] = '\0';
+
+    return st;
+}
+
+static void free_state(struct state *st)
+{
+    struct env *env = &st->env;
+    struct compiler *c = &st->compiler;
+
+    release(env, c->image.buf);
+    release(env, c->strings.buf);
+    release(env, c->labels.name);
+    release(env, c->labels.hash);
+    release(env, c->labels.len);
+    release(env, c->labels.addr);
+    release(env, c->labels.is_defined);
+    release(env, c->labels.scope);
+    release(env, c->labels.slots);
+    release(env, c->fixups.at);
+    release(env, c->fixups.label);
+    release(env, c->fixups.line);
+    release(env, c->fixups.kind);
+    release(env, c->relocs.buf);
+    release(env, c->lines.addr);
+    release(env, c->lines.nr);
+    release(env, st);
+}
+
+static int assemble(struct state *st, struct lc3_image *out)
+{
+    if (st == NULL) return -1;
+
+    struct env *env = &st->env;
+    if (setjmp(env->fail) == 0) {
+        labels_slots(env, &st->compiler.labels, 64);
+        compile(&st->compiler);
+        if (env->diags->count == 0) finish(&st->compiler, out);
+    }
+
+    int is_ok = env->diags->count == 0;
+    if (!is_ok) lc3_image_free(out);
+    free_state(st);
+    return is_ok ? 0 : -1;
+}
+
+int lc3_assemble(const char *src, size_t len, struct lc3_image *out,
+        struct lc3_diag *diags)
+{
+    return assemble(make_state(out, diags, -1, src, len), out);
+}
+
+int lc3_assemble_fd(int fd, struct lc3_image *out, struct lc3_diag *diags)
+{
+    return assemble(make_state(out, diags, fd, NULL, 0), out);
+}
+
+void lc3_image_free(struct lc3_image *img)
+{
+    struct lc3_allocator alloc = lc3_image_allocator(img);
+    void *bufs[] = {img->words, img->labels, img->names, img->relocs,
+        img->line_addr, img->line_nr};
+
+    for (size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]); ++i) {
+        if (bufs[i] != NULL) alloc.free(alloc.ctx, bufs[i]);
+    }
+
+    struct lc3_allocator keep = img->alloc;
+    memset(img, 0, sizeof(*img));
+    img->alloc = keep;
+}
+
+// @NOTE(art): object files are little endian, one write for the whole thing
+static int write_words(struct lc3_image *img, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < img->size; ++i) {
+        img->words[i] = img->words[i] << 8 | img->words[i] >> 8;
+    }
+#endif
+
+    char *p = (char *) img->words;
+    size_t left = img->size * sizeof(u16);
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            perror("write");
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < img->size; ++i) {
+        img->words[i] = img->words[i] << 8 | img->words[i] >> 8;
+    }
+#endif
+
+    if (close(fd) < 0) {
+        perror("close");
+        return -1;
+    }
+    return left == 0 ? 0 : -1;
+}
 
-        c.addr_offset += 1;
+// @NOTE(art): `label xADDR name` and `line xADDR source_line`, for profiler
+static int write_symbols(struct lc3_image *img, const char *path)
+{
+    FILE *sym = fopen(path, "w");
+    if (sym == NULL) {
+        perror(path);
+        return -1;
     }
 
-    fflush(out);
+    for (size_t i = 0; i < img->labels_size; ++i) {
+        struct lc3_label *l = img->labels + i;
+        if (l->scope == LC3_EXTERNAL) continue;
+        fprintf(sym, "label x%04X %.*s\n", l->addr, (int) l->len, l->name);
+    }
+    for (size_t i = 0; i < img->lines_size; ++i) {
+        fprintf(sym, "line x%04X %u\n", img->line_addr[i], img->line_nr[i]);
+    }
 
+    if (fclose(sym) != 0) {
+        perror("fclose");
+        return -1;
+    }
     return 0;
 }
+
+int lc3_image_write(struct lc3_image *img, const char *obj_path,
+        const char *sym_path)
+{
+    if (sym_path != NULL && write_symbols(img, sym_path) < 0) return -1;
+    return write_words(img, obj_path);
+}
+
+// @NOTE(art): `path: [line N] at token: message`, parts that are not known
+// are left out
+void lc3_diag_print(struct lc3_diag *diags, const char *path, FILE *out)
+{
+    size_t kept = diags->count < LC3_DIAG_CAP ? diags->count : LC3_DIAG_CAP;
+    for (size_t i = 0; i < kept; ++i) {
+        struct lc3_diag_entry *e = diags->buf + i;
+        if (path != NULL) fprintf(out, "%s: ", path);
+        if (e->line > 0) fprintf(out, "[line %zu] ", e->line);
+        if (e->at[0] != '\0') fprintf(out, "at %s: ", e->at);
+        fprintf(out, "%s\n", e->msg);
+    }
+    if (diags->count > kept) {
+        fprintf(out, "... and %zu more\n", diags->count - kept);
+    }
+}
+
+// @NOTE(art): scanner alone over the whole input, for bench/lex.sh
+long lc3_lex_fd(int fd, size_t *bytes, struct lc3_diag *diags)
+{
+    struct lc3_image img = {0};
+    struct state *st = make_state(&img, diags, fd, NULL, 0);
+    if (st == NULL) return -1;
+
+    struct scanner *s = &st->scanner;
+    long tokens = 0;
+    if (setjmp(st->env.fail) == 0) {
+        struct token t;
+        do {
+            scan_token(s, &t);
+            tokens++;
+        } while (t.kind != T_EOF);
+    } else {
+        tokens = -1;
+    }
+
+    // @NOTE(art): nothing rebases here, so `moved` is all bytes dropped
+    *bytes = s->moved + (s->end - s->buf);
+
+    free_state(st);
+    return tokens;
+}
@@ -0,0 +1,221 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lc3.h"
+
+#define PATH_CAP 4096
+
+static int lex(int fd)
+{
+    struct timespec t0, t1;
+    struct lc3_diag diags;
+    size_t bytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long tokens = lc3_lex_fd(fd, &bytes, &diags);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    lc3_diag_print(&diags, NULL, stderr);
+    if (tokens < 0) return 1;
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "bytes %zu\n", bytes);
+    fprintf(stderr, "tokens %ld\n", tokens);
+    fprintf(stderr, "seconds %.6f\n", seconds);
+    fprintf(stderr, "gbps %.2f\n", bytes / seconds / 1e9);
+    return 0;
+}
+
+// @NOTE(art): inputs are split between workers through a shared index.
+// Each one is assembled (or read, when it is a .rel) into its own image,
+// with -c the relocatable object is written by the worker too.
+struct pool {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t size;
+    char **paths;
+    struct lc3_image *imgs;
+    struct lc3_diag *diags;
+    int *errs;
+    int is_compile_only;
+};
+
+static int has_suffix(const char *path, const char *suffix)
+{
+    size_t len = strlen(path), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(path + len - suffix_len, suffix) == 0;
+}
+
+// @NOTE(art): `name.asm` becomes `name.ext`, other names get `.ext` added
+static void swap_suffix(char *dst, size_t cap, const char *path,
+        const char *ext)
+{
+    int len = strlen(path) - (has_suffix(path, ".asm") ? 4 : 0);
+    snprintf(dst, cap, "%.*s%s", len, path, ext);
+}
+
+static int build(struct pool *p, size_t i)
+{
+    char *path = p->paths[i];
+    p->diags[i].count = 0;
+
+    if (has_suffix(path, ".rel")) return lc3_image_read_rel(p->imgs + i, path);
+
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    int err = lc3_assemble_fd(fd, p->imgs + i, p->diags + i);
+    if (fd != STDIN_FILENO) close(fd);
+    if (err || !p->is_compile_only) return err;
+
+    char rel[PATH_CAP];
+    swap_suffix(rel, sizeof(rel), strcmp(path, "-") == 0 ? "out" : path,
+            ".rel");
+    return lc3_image_write_rel(p->imgs + i, rel);
+}
+
+static void *worker_main(void *arg)
+{
+    struct pool *p = arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        size_t i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        if (i >= p->size) return NULL;
+        p->errs[i] = build(p, i);
+    }
+}
+
+static int build_all(struct pool *p, size_t jobs)
+{
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (size_t) cpus : 1;
+    }
+    if (jobs > p->size) jobs = p->size;
+
+    // @LEAK(art): let OS free it
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    size_t started = 0;
+    for (; started + 1 < jobs; ++started) {
+        if (pthread_create(threads + started, NULL, worker_main, p) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    // @NOTE(art): main thread is the last worker
+    worker_main(p);
+    for (size_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [--lex] [file.asm|-]\n"
+            "       %s [-c] [-o out.obj] [-j jobs] file.asm|file.rel...\n",
+            name, name);
+}
+
+// @NOTE(art): reads ./ex.asm by default, `-` is stdin. Inputs are assembled
+// in parallel and linked into out.obj (and out.sym), with -c each one is
+// only written as relocatable `name.rel`. With --lex only scans the input
+// and prints throughput.
+int main(int argc, char **argv)
+{
+    int is_lex = 0;
+    int is_compile_only = 0;
+    char *out_path = "out.obj";
+    size_t jobs = 0;
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; ++arg) {
+        if (strcmp(argv[arg], "--lex") == 0) {
+            is_lex = 1;
+        } else if (strcmp(argv[arg], "-c") == 0) {
+            is_compile_only = 1;
+        } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            out_path = argv[++arg];
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+            jobs = strtoul(argv[++arg], NULL, 10);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char *default_path = "./ex.asm";
+    char **paths = arg < argc ? argv + arg : &default_path;
+    size_t size = arg < argc ? (size_t) (argc - arg) : 1;
+
+    if (is_lex) {
+        if (size != 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        int fd = strcmp(paths[0], "-") == 0 ? STDIN_FILENO
+            : open(paths[0], O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+        return lex(fd);
+    }
+
+    // @LEAK(art): let OS free it
+    struct pool p = {
+        .size = size,
+        .paths = paths,
+        .imgs = calloc(size, sizeof(struct lc3_image)),
+        .diags = malloc(size * sizeof(struct lc3_diag)),
+        .errs = calloc(size, sizeof(int)),
+        .is_compile_only = is_compile_only
+    };
+    if (p.imgs == NULL || p.diags == NULL || p.errs == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    if (build_all(&p, jobs) < 0) return 1;
+
+    int failed = 0;
+    for (size_t i = 0; i < size; ++i) {
+        lc3_diag_print(p.diags + i, size > 1 ? paths[i] : NULL, stderr);
+        failed |= p.errs[i] != 0;
+    }
+    if (failed) return 1;
+    if (is_compile_only) return 0;
+
+    // @LEAK(art): let OS free it
+    struct lc3_image img = {0};
+    struct lc3_diag diags;
+
+    int err = lc3_link(p.imgs, size, &img, &diags);
+    lc3_diag_print(&diags, NULL, stderr);
+    if (err) return 1;
+
+    char sym_path[PATH_CAP];
+    int len = strlen(out_path) - (has_suffix(out_path, ".obj") ? 4 : 0);
+    snprintf(sym_path, sizeof(sym_path), "%.*s.sym", len, out_path);
+
+    if (lc3_image_write(&img, out_path, sym_path) < 0) return 1;
+
+    return 0;
+}
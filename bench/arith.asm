@@ -0,0 +1,18 @@
+; ALU bound nested loop, ~100M instructions
+.orig x3000
+        ld r3, outer
+oloop   ld r1, inner
+iloop   add r0, r0, #1
+        and r2, r0, #7
+        add r2, r2, r0
+        not r4, r2,
+        add r5, r4, r2
+        and r6, r5, r0
+        add r1, r1, #-1
+        brp iloop
+        add r3, r3, #-1
+        brp oloop
+        halt
+outer   .fill #1250
+inner   .fill #10000
+.end
@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# usage: bench/lex.sh [megabytes]
+# Lexing throughput of asm on two generated sources (32MB by default): dense
+# code with short comments, and a commented listing with long comment and
+# string runs. For the scalar scanner and the SSE2 and AVX2 ones, best of 3.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+MB=${1:-32}
+
+awk -v bytes=$((MB << 20)) 'BEGIN {
+    print ".orig x3000"
+    for (i = 0; size < bytes; ++i) {
+        line = sprintf("LOOP%d   ADD R%d, R%d, #%d     ; step %d of the loop\n", \
+            i, i % 8, (i + 3) % 8, i % 16, i)
+        line = line sprintf("        ldr r2, r5, #1\n        BRnzp LOOP%d\n", i)
+        if (i % 16 == 0) {
+            line = line sprintf("MSG%d .STRINGZ \"Hello, World %d\"\n", i, i)
+        }
+        line = line "        ; -------------------------------------------\n"
+        printf "%s", line
+        size += length(line)
+    }
+}' > "$TMP/dense.asm"
+
+awk -v bytes=$((MB << 20)) 'BEGIN {
+    print ".orig x3000"
+    for (i = 0; size < bytes; ++i) {
+        line = sprintf("        ; %s %d\n", \
+            "walks the table and sums every entry into R0 until it hits zero", i)
+        line = line sprintf("        add r0, r0, r1\n")
+        line = line sprintf("STR%d    .stringz \"%s\"\n", i, \
+            "The quick brown fox jumps over the lazy dog, twice over.")
+        printf "%s", line
+        size += length(line)
+    }
+}' > "$TMP/prose.asm"
+
+printf "%-8s %-6s %10s %9s %7s\n" scanner input tokens seconds gbps
+
+for variant in scalar:-DASM_SCALAR sse2: avx2:-mavx2; do
+    name=${variant%%:*}
+    flags=${variant#*:}
+    if ! gcc -O2 $flags -std=c11 -o "$TMP/asm" "$ROOT/asmcli.c" "$ROOT/asm.c" "$ROOT/link.c" -pthread 2> /dev/null; then
+        printf "%-8s %-6s %10s\n" "$name" - -
+        continue
+    fi
+
+    for input in dense prose; do
+        best=""
+        for run in 1 2 3; do
+            "$TMP/asm" --lex "$TMP/$input.asm" 2> "$TMP/stats"
+            seconds=$(awk '$1 == "seconds" { print $2 }' "$TMP/stats")
+            if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+                best=$seconds
+                best_line=$(awk -v name="$name" -v input="$input" '
+                    { v[$1] = $2 }
+                    END {
+                        printf "%-8s %-6s %10s %9s %7s\n", name, input,
+                            v["tokens"], v["seconds"], v["gbps"]
+                    }' "$TMP/stats")
+            fi
+        done
+        echo "$best_line"
+    done
+done
@@ -0,0 +1,21 @@
+; LDR/STR read-modify-write sweeps over 16K words at x4000, ~100M instructions
+.orig x3000
+        ld r3, passes
+pass    ld r5, base
+        ld r1, words
+sweep   ldr r2, r5, #0
+        add r2, r2, r1
+        str r2, r5, #0
+        ldr r4, r5, #1
+        add r4, r4, r2
+        str r4, r5, #1
+        add r5, r5, #2
+        add r1, r1, #-2
+        brp sweep
+        add r3, r3, #-1
+        brp pass
+        halt
+base    .fill x4000
+words   .fill #16384
+passes  .fill #1350
+.end
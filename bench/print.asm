@@ -0,0 +1,11 @@
+; PUTS in a loop, ~1.3MB of console output
+.orig x3000
+        ld r3, reps
+loop    lea r0, msg
+        puts
+        add r3, r3, #-1
+        brp loop
+        halt
+reps    .fill #30000
+msg     .stringz "the quick brown fox jumps over the lazy dog\n"
+.end
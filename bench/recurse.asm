@@ -0,0 +1,39 @@
+; recursive fib(20) through JSR/RET with a stack in R6, ~100M instructions
+.orig x3000
+        ld r6, stack
+        ld r4, reps
+again   and r0, r0, #0
+        add r0, r0, #10
+        add r0, r0, #10
+        jsr fib
+        add r4, r4, #-1
+        brp again
+        and r1, r1, #15
+        ld r0, letter
+        add r0, r0, r1
+        out
+        halt
+fib     add r6, r6, #-1
+        str r7, r6, #0
+        add r1, r0, #-2
+        brzp rec
+        add r1, r0, #0
+        brnzp done
+rec     add r6, r6, #-1
+        str r0, r6, #0
+        add r0, r0, #-1
+        jsr fib
+        ldr r0, r6, #0
+        str r1, r6, #0
+        add r0, r0, #-2
+        jsr fib
+        ldr r2, r6, #0
+        add r1, r1, r2
+        add r6, r6, #1
+done    ldr r7, r6, #0
+        add r6, r6, #1
+        ret
+stack   .fill x7000
+reps    .fill #300
+letter  .fill x41
+.end
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# usage: bench/run.sh [name...]
+# Assembles and runs every bench/*.asm (or the ones named) with the lc3 and
+# asm from the repo root, prints instructions, time, MIPS and cycles per
+# instruction. Program output goes to /dev/null.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$ROOT/bench" && ls *.asm | sed 's/\.asm$//')
+fi
+
+printf "%-10s %12s %9s %9s %6s\n" bench instructions seconds mips cpi
+
+for name in "$@"; do
+    cp "$ROOT/bench/$name.asm" "$TMP/ex.asm"
+    (cd "$TMP" && "$ROOT/asm" > /dev/null)
+    "$ROOT/lc3" --stats "$TMP/out.obj" > /dev/null 2> "$TMP/stats" < /dev/null
+
+    awk -v name="$name" '
+        { v[$1] = $2 }
+        END {
+            printf "%-10s %12s %9s %9s %6s\n", name, v["instructions"],
+                v["seconds"], v["mips"], v["cpi"]
+        }' "$TMP/stats"
+done
@@ -0,0 +1,23 @@
+; rewrites an instruction of its own loop on every iteration, alternating
+; between two encodings, worst case for anything that caches decoded or
+; translated code
+.orig x3000
+        ld r3, outer
+oloop   ld r1, inner
+iloop   and r4, r1, #1
+        brz even
+        ld r2, insn1
+        brnzp write
+even    ld r2, insn2
+write   st r2, patch
+patch   add r0, r0, #1
+        add r1, r1, #-1
+        brp iloop
+        add r3, r3, #-1
+        brp oloop
+        halt
+insn1   .fill x1021
+insn2   .fill x1022
+outer   .fill #20
+inner   .fill #10000
+.end
@@ -7,20 +7,64 @@ if [ "$1" = "clean" ]; then
     exit 0
 fi
 
-FLAGS_PROD="-g -Wall -Wextra -std=c11 -pedantic"
-FLAGS_DEF="-g -Wextra -std=c11 -pedantic"
+# keywords: regenerates keywords.h, the scanner's keyword table
+if [ "$1" = "keywords" ]; then
+    gcc -std=c11 -pedantic -Wall -Wextra -o kwgen kwgen.c
+    ./kwgen > keywords.h
+    rm -f kwgen
+    exit 0
+fi
+
+# bench: optimized build of both, then bench/run.sh and bench/lex.sh.
+# Engine options apply.
+if [ "$1" = "bench" ]; then
+    shift
+    FLAGS_BENCH="-O2" ./build.sh prod "$@"
+    bench/run.sh
+    exec bench/lex.sh
+fi
+
+FLAGS_PROD="-g -Wall -Wextra -std=c11 -pedantic $FLAGS_BENCH"
+FLAGS_DEF="-g -Wextra -std=c11 -pedantic $FLAGS_BENCH"
 
 FLAGS=$FLAGS_DEF
+LC3_FLAGS=""
+ASM_FLAGS=""
+LC3_SRC="lc3.c vm.c prof.c asm.c link.c"
 
-if [ "$1" = "prod" ] || [ "$2" = "prod" ]; then
+if [[ " $* " == *" prod "* ]]; then
     FLAGS=$FLAGS_PROD
 fi
 
+# threaded: computed goto dispatch (gcc/clang only), switch otherwise.
+# PRE merges the per-handler dispatch back into one jump, so it is off.
+if [[ " $* " == *" threaded "* ]]; then
+    LC3_FLAGS="$LC3_FLAGS -DLC3_THREADED -fno-tree-pre"
+fi
+
+# table: instruction decoded through a table of all 65536 words, built at
+# startup, instead of the per-address predecode cache
+if [[ " $* " == *" table "* ]]; then
+    LC3_FLAGS="$LC3_FLAGS -DLC3_DECODE_TABLE"
+fi
+
+# jit: x86-64 basic block translator, interpreter handles TRAP and RTI
+if [[ " $* " == *" jit "* ]]; then
+    LC3_FLAGS="$LC3_FLAGS -DLC3_JIT"
+    LC3_SRC="$LC3_SRC jit.c"
+fi
+
+# avx2: 32 byte scanner in asm instead of SSE2 one (see span_* in asm.c)
+if [[ " $* " == *" avx2 "* ]]; then
+    ASM_FLAGS="$ASM_FLAGS -mavx2"
+fi
+
 if [ "$1" = "lc3" ]; then
-    gcc $FLAGS -o lc3 lc3.c
+    gcc $FLAGS $LC3_FLAGS -o lc3 $LC3_SRC -pthread
 elif [ "$1" = "asm" ]; then
-    gcc $FLAGS -o asm asm.c
+    gcc $FLAGS $ASM_FLAGS -o asm asmcli.c asm.c link.c -pthread
 else
-    gcc $FLAGS -o lc3 lc3.c &
-    gcc $FLAGS -o asm asm.c
+    gcc $FLAGS $LC3_FLAGS -o lc3 $LC3_SRC -pthread &
+    gcc $FLAGS $ASM_FLAGS -o asm asmcli.c asm.c link.c -pthread
+    wait $!
 fi
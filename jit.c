@@ -0,0 +1,614 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+
+// @NOTE(art): basic block translator from LC-3 to x86-64 (System V).
+//
+// Block starts at some PC and ends at BR, JMP, JSR or right before TRAP, RTI
+// and reserved opcode, which are left to the C side. Inside a block LC-3
+// R0-R7 live in host r8-r15, loaded lazily and written back at block exit.
+// Condition codes are tracked at translation time: we only remember which
+// register produced the last result and write N/Z/P into PSR once, when block
+// exits.
+//
+// Fixed host registers while running translated code:
+//   rdi - regs, rsi - memory, rbx - code map (1 per translated word)
+//   rax, rcx, rdx - scratch
+//
+// Exits return to jit_run() with rax holding one of EXIT_* or an address of
+// rel32 inside a `jmp` which should be patched to chain into block at PC.
+
+#define CODE_CAP (16 << 20)
+#define BLOCK_MAX_INST 64
+// @NOTE(art): generous upper bound of bytes emitted for one block
+#define BLOCK_MAX_BYTES (BLOCK_MAX_INST * 256)
+#define BLOCKS_CAP (1 << 16)
+
+#define REG_DISP(r) ((r) * 2)
+#define INSTRET_DISP \
+    (offsetof(struct lc3_vm, instret) - offsetof(struct lc3_vm, regs))
+#define DIRTY_DISP \
+    (offsetof(struct lc3_vm, dirty) - offsetof(struct lc3_vm, regs))
+#define CHECK_AT_DISP \
+    (offsetof(struct lc3_vm, check_at) - offsetof(struct lc3_vm, regs))
+
+enum {
+    EXIT_PLAIN = 0,
+    EXIT_SMC = 1
+};
+
+enum {
+    CC_NONE = -1
+};
+
+struct block_range {
+    u16 start;
+    u16 len;
+};
+
+struct jit {
+    unsigned char *code;
+    unsigned char *p;
+    unsigned char *exit;
+    uintptr_t (*enter)(u16 *regs, u16 *memory, unsigned char *map,
+            unsigned char *block);
+
+    unsigned char *blocks[MEMORY_CAP];
+    unsigned char map[MEMORY_CAP];
+    struct block_range ranges[BLOCKS_CAP];
+    size_t ranges_size;
+    size_t generation;
+};
+
+// @NOTE(art): translation time state of a block, `retired` is number of
+// instructions done when control leaves at the current point
+struct block_state {
+    unsigned loaded;
+    unsigned dirty;
+    int cc;
+    unsigned retired;
+};
+
+static void emit8(struct jit *j, unsigned char byte)
+{
+    *j->p++ = byte;
+}
+
+static void emit32(struct jit *j, uint32_t value)
+{
+    memcpy(j->p, &value, sizeof(value));
+    j->p += sizeof(value);
+}
+
+static void emit64(struct jit *j, uint64_t value)
+{
+    memcpy(j->p, &value, sizeof(value));
+    j->p += sizeof(value);
+}
+
+static void emit_rel32(struct jit *j, unsigned char *target)
+{
+    emit32(j, (uint32_t) (target - (j->p + 4)));
+}
+
+static void patch_rel32(unsigned char *at, unsigned char *target)
+{
+    uint32_t rel = (uint32_t) (target - (at + 4));
+    memcpy(at, &rel, sizeof(rel));
+}
+
+// movzx rN, word [rdi + r*2]
+static void emit_load_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x44); emit8(j, 0x0F); emit8(j, 0xB7);
+    emit8(j, 0x40 | r << 3 | 0x7); emit8(j, REG_DISP(r));
+}
+
+// mov word [rdi + r*2], rNw
+static void emit_spill_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x66); emit8(j, 0x44); emit8(j, 0x89);
+    emit8(j, 0x40 | r << 3 | 0x7); emit8(j, REG_DISP(r));
+}
+
+static void use_reg(struct jit *j, struct block_state *b, unsigned r)
+{
+    if (b->loaded >> r & 0x1) return;
+    emit_load_reg(j, r);
+    b->loaded |= 1u << r;
+}
+
+// mov eax, rN
+static void emit_mov_eax_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x44); emit8(j, 0x89); emit8(j, 0xC0 | r << 3);
+}
+
+// mov ecx, rN
+static void emit_mov_ecx_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x44); emit8(j, 0x89); emit8(j, 0xC0 | r << 3 | 0x1);
+}
+
+// movzx rN, ax
+static void emit_movzx_reg_eax(struct jit *j, unsigned r)
+{
+    emit8(j, 0x44); emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC0 | r << 3);
+}
+
+// test rNw, rNw
+static void emit_test_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x66); emit8(j, 0x45); emit8(j, 0x85); emit8(j, 0xC0 | r << 3 | r);
+}
+
+// mov word [rdi + PC], imm16
+static void emit_set_pc(struct jit *j, u16 pc)
+{
+    emit8(j, 0x66); emit8(j, 0xC7); emit8(j, 0x47); emit8(j, REG_DISP(R_PC));
+    emit8(j, pc & 0xFF); emit8(j, pc >> 8);
+}
+
+// mov word [rdi + PC], rNw
+static void emit_set_pc_reg(struct jit *j, unsigned r)
+{
+    emit8(j, 0x66); emit8(j, 0x44); emit8(j, 0x89);
+    emit8(j, 0x40 | r << 3 | 0x7); emit8(j, REG_DISP(R_PC));
+}
+
+// @NOTE(art): same as setcc(), but branch free, from host register
+static void emit_setcc(struct jit *j, unsigned r)
+{
+    emit8(j, 0xB9); emit32(j, CC_Z);                    // mov ecx, Z
+    emit8(j, 0xB8); emit32(j, CC_N);                    // mov eax, N
+    emit8(j, 0xBA); emit32(j, CC_P);                    // mov edx, P
+    emit_test_reg(j, r);
+    emit8(j, 0x0F); emit8(j, 0x48); emit8(j, 0xC8);     // cmovs ecx, eax
+    emit8(j, 0x0F); emit8(j, 0x4F); emit8(j, 0xCA);     // cmovg ecx, edx
+    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x47);
+    emit8(j, REG_DISP(R_PSR));                          // movzx eax, [PSR]
+    emit8(j, 0x25); emit32(j, 0x8000);                  // and eax, 0x8000
+    emit8(j, 0x09); emit8(j, 0xC8);                     // or eax, ecx
+    emit8(j, 0x66); emit8(j, 0x89); emit8(j, 0x47);
+    emit8(j, REG_DISP(R_PSR));                          // mov [PSR], ax
+}
+
+// @NOTE(art): makes regs[], PSR and instret up to date, does not change
+// block state so it can be used on side exits
+static void emit_writeback(struct jit *j, struct block_state *b)
+{
+    for (unsigned r = 0; r < 8; ++r) {
+        if (b->dirty >> r & 0x1) emit_spill_reg(j, r);
+    }
+    if (b->cc != CC_NONE) emit_setcc(j, b->cc);
+    if (b->retired > 0) {
+        emit8(j, 0x48); emit8(j, 0x81); emit8(j, 0x87);
+        emit32(j, INSTRET_DISP); emit32(j, b->retired); // add [instret], imm32
+    }
+}
+
+static void emit_exit(struct jit *j, uintptr_t code)
+{
+    if (code == EXIT_PLAIN) {
+        emit8(j, 0x31); emit8(j, 0xC0);                 // xor eax, eax
+    } else {
+        emit8(j, 0xB8); emit32(j, code);                // mov eax, code
+    }
+    emit8(j, 0xE9); emit_rel32(j, j->exit);
+}
+
+// @NOTE(art): jump to block at PC. Goes back to jit_run() the first time,
+// which translates the target and patches the jump to go there directly.
+// Also goes back once instret reaches vm->check_at, so limits and
+// checkpoints are looked at even when all hot blocks are chained.
+static void emit_chain(struct jit *j, u16 pc)
+{
+    emit_set_pc(j, pc);
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x87);
+    emit32(j, INSTRET_DISP);                            // mov rax, [instret]
+    emit8(j, 0x48); emit8(j, 0x3B); emit8(j, 0x87);
+    emit32(j, CHECK_AT_DISP);                           // cmp rax, [check_at]
+    emit8(j, 0x72); emit8(j, 0x07);                     // jb +7
+    emit_exit(j, EXIT_PLAIN);
+    emit8(j, 0xE9);
+    unsigned char *site = j->p;
+    emit_rel32(j, j->p + 4);
+    // mov rax, site
+    emit8(j, 0x48); emit8(j, 0xB8); emit64(j, (uintptr_t) site);
+    emit8(j, 0xE9); emit_rel32(j, j->exit);
+}
+
+// @NOTE(art): register about to be overwritten by something that does not
+// set condition codes, so flags have to be saved while value is still there
+static void clobber_reg(struct jit *j, struct block_state *b, unsigned r)
+{
+    if (b->cc == (int) r) {
+        emit_setcc(j, r);
+        b->cc = CC_NONE;
+    }
+    b->loaded |= 1u << r;
+    b->dirty |= 1u << r;
+}
+
+static void set_reg_cc(struct block_state *b, unsigned r)
+{
+    b->loaded |= 1u << r;
+    b->dirty |= 1u << r;
+    b->cc = r;
+}
+
+// @NOTE(art): stores value of register `src` at address in ecx and marks
+// its page dirty, like mem_write() in vm.c. If address belongs to translated
+// code, leaves block right after the store.
+static void emit_store(struct jit *j, struct block_state *b, unsigned src,
+        u16 next_pc)
+{
+    use_reg(j, b, src);
+
+    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC9);     // movzx ecx, cx
+    emit8(j, 0x66); emit8(j, 0x44); emit8(j, 0x89);
+    emit8(j, 0x04 | src << 3); emit8(j, 0x4E);          // mov [rsi+rcx*2], rNw
+    emit8(j, 0x89); emit8(j, 0xCA);                     // mov edx, ecx
+    emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, 0x09);     // shr edx, 9
+    // mov byte [rdi+rdx+dirty], DIRTY_ALL
+    emit8(j, 0xC6); emit8(j, 0x84); emit8(j, 0x17);
+    emit32(j, DIRTY_DISP); emit8(j, DIRTY_ALL);
+    // cmp byte [rbx+rcx], 0
+    emit8(j, 0x80); emit8(j, 0x3C); emit8(j, 0x0B); emit8(j, 0x00);
+    emit8(j, 0x0F); emit8(j, 0x84);                     // je rel32
+    unsigned char *skip = j->p;
+    emit32(j, 0);
+
+    emit_writeback(j, b);
+    emit_set_pc(j, next_pc);
+    emit_exit(j, EXIT_SMC);
+
+    patch_rel32(skip, j->p);
+}
+
+static void emit_br(struct jit *j, struct block_state *b, u16 nzp, u16 taken,
+        u16 fallthrough)
+{
+    emit_writeback(j, b);
+
+    // @NOTE(art): BRnzp is only sure to be taken when block set condition
+    // codes. PSR coming from outside may hold none of N/Z/P (fresh machine,
+    // PSR popped by RTI), then it is not taken, like in vm.c.
+    if (nzp == 0x7 && b->cc != CC_NONE) {
+        emit_chain(j, taken);
+        return;
+    }
+    if (nzp == 0x0) {
+        emit_chain(j, fallthrough);
+        return;
+    }
+
+    unsigned char jcc;
+    if (b->cc != CC_NONE) {
+        emit_test_reg(j, b->cc);
+        switch (nzp) {
+        case 0x4: jcc = 0x88; break;                    // js
+        case 0x2: jcc = 0x84; break;                    // je
+        case 0x1: jcc = 0x8F; break;                    // jg
+        case 0x6: jcc = 0x8E; break;                    // jle
+        case 0x5: jcc = 0x85; break;                    // jne
+        default: jcc = 0x89; break;                     // jns
+        }
+    } else {
+        emit8(j, 0xF6); emit8(j, 0x47); emit8(j, REG_DISP(R_PSR));
+        emit8(j, nzp);                                  // test byte [PSR], nzp
+        jcc = 0x85;                                     // jne
+    }
+
+    emit8(j, 0x0F); emit8(j, jcc);
+    unsigned char *to_taken = j->p;
+    emit32(j, 0);
+
+    emit_chain(j, fallthrough);
+    patch_rel32(to_taken, j->p);
+    emit_chain(j, taken);
+}
+
+static void emit_trampoline(struct jit *j)
+{
+    j->enter = (uintptr_t (*)(u16 *, u16 *, unsigned char *,
+                unsigned char *)) (uintptr_t) j->p;
+    emit8(j, 0x53);                                     // push rbx
+    emit8(j, 0x55);                                     // push rbp
+    emit8(j, 0x41); emit8(j, 0x54);                     // push r12
+    emit8(j, 0x41); emit8(j, 0x55);                     // push r13
+    emit8(j, 0x41); emit8(j, 0x56);                     // push r14
+    emit8(j, 0x41); emit8(j, 0x57);                     // push r15
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xD3);     // mov rbx, rdx
+    emit8(j, 0xFF); emit8(j, 0xE1);                     // jmp rcx
+
+    j->exit = j->p;
+    emit8(j, 0x41); emit8(j, 0x5F);                     // pop r15
+    emit8(j, 0x41); emit8(j, 0x5E);                     // pop r14
+    emit8(j, 0x41); emit8(j, 0x5D);                     // pop r13
+    emit8(j, 0x41); emit8(j, 0x5C);                     // pop r12
+    emit8(j, 0x5D);                                     // pop rbp
+    emit8(j, 0x5B);                                     // pop rbx
+    emit8(j, 0xC3);                                     // ret
+}
+
+void jit_flush(struct jit *j)
+{
+    for (size_t i = 0; i < j->ranges_size; ++i) {
+        struct block_range *r = j->ranges + i;
+        j->blocks[r->start] = NULL;
+        for (u16 k = 0; k < r->len; ++k) {
+            j->map[(u16) (r->start + k)] = 0;
+        }
+    }
+    j->ranges_size = 0;
+    j->generation++;
+
+    j->p = j->code;
+    emit_trampoline(j);
+}
+
+static unsigned char *compile(struct jit *j, u16 *memory, u16 start)
+{
+    if ((size_t) (j->p - j->code) + BLOCK_MAX_BYTES > CODE_CAP ||
+            j->ranges_size == BLOCKS_CAP) {
+        jit_flush(j);
+    }
+
+    unsigned char *block = j->p;
+    struct block_state b = {
+        .loaded = 0,
+        .dirty = 0,
+        .cc = CC_NONE,
+        .retired = 0
+    };
+
+    u16 pc = start;
+    size_t len = 0;
+    int is_done = 0;
+
+    while (!is_done) {
+        u16 inst = memory[pc];
+        u16 opcode = inst >> 12;
+        u16 next_pc = pc + 1;
+
+        if (len == BLOCK_MAX_INST || opcode == OP_TRAP ||
+                opcode == OP_RTI || opcode == OP_RESERVED) {
+            emit_writeback(j, &b);
+            emit_chain(j, pc);
+            break;
+        }
+
+        j->map[pc] = 1;
+        len++;
+        b.retired++;
+
+        unsigned dst = inst >> 9 & 0x7;
+        unsigned src = inst >> 6 & 0x7;
+
+        switch (opcode) {
+        case OP_ADD:
+        case OP_AND:
+            use_reg(j, &b, src);
+            emit_mov_eax_reg(j, src);
+            if (inst >> 5 & 0x1) {
+                u16 imm5 = sext(inst & 0x1F, 5);
+                emit8(j, opcode == OP_ADD ? 0x05 : 0x25); // add/and eax, imm32
+                emit32(j, imm5);
+            } else {
+                unsigned src2 = inst & 0x7;
+                use_reg(j, &b, src2);
+                emit8(j, 0x44);
+                emit8(j, opcode == OP_ADD ? 0x01 : 0x21); // add/and eax, rN
+                emit8(j, 0xC0 | src2 << 3);
+            }
+            emit_movzx_reg_eax(j, dst);
+            set_reg_cc(&b, dst);
+            break;
+
+        case OP_NOT:
+            use_reg(j, &b, src);
+            emit_mov_eax_reg(j, src);
+            emit8(j, 0xF7); emit8(j, 0xD0);             // not eax
+            emit_movzx_reg_eax(j, dst);
+            set_reg_cc(&b, dst);
+            break;
+
+        case OP_LD: {
+            u16 addr = next_pc + sext(inst & 0x1FF, 9);
+            emit8(j, 0x44); emit8(j, 0x0F); emit8(j, 0xB7);
+            emit8(j, 0x80 | dst << 3 | 0x6);
+            emit32(j, addr * 2);                        // movzx rN, [rsi+disp]
+            set_reg_cc(&b, dst);
+        } break;
+
+        case OP_LDI: {
+            u16 addr = next_pc + sext(inst & 0x1FF, 9);
+            emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x86);
+            emit32(j, addr * 2);                        // movzx eax, [rsi+disp]
+            emit8(j, 0x44); emit8(j, 0x0F); emit8(j, 0xB7);
+            emit8(j, 0x04 | dst << 3); emit8(j, 0x46);  // movzx rN, [rsi+rax*2]
+            set_reg_cc(&b, dst);
+        } break;
+
+        case OP_LDR: {
+            u16 offset6 = sext(inst & 0x3F, 6);
+            use_reg(j, &b, src);
+            emit_mov_eax_reg(j, src);
+            emit8(j, 0x05); emit32(j, offset6);         // add eax, imm32
+            emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC0); // movzx eax, ax
+            emit8(j, 0x44); emit8(j, 0x0F); emit8(j, 0xB7);
+            emit8(j, 0x04 | dst << 3); emit8(j, 0x46);  // movzx rN, [rsi+rax*2]
+            set_reg_cc(&b, dst);
+        } break;
+
+        case OP_LEA: {
+            u16 addr = next_pc + sext(inst & 0x1FF, 9);
+            clobber_reg(j, &b, dst);
+            // mov rN, imm32
+            emit8(j, 0x41); emit8(j, 0xB8 | dst); emit32(j, addr);
+        } break;
+
+        case OP_ST: {
+            u16 addr = next_pc + sext(inst & 0x1FF, 9);
+            emit8(j, 0xB9); emit32(j, addr);            // mov ecx, imm32
+            emit_store(j, &b, dst, next_pc);
+        } break;
+
+        case OP_STI: {
+            u16 addr = next_pc + sext(inst & 0x1FF, 9);
+            emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x8E);
+            emit32(j, addr * 2);                        // movzx ecx, [rsi+disp]
+            emit_store(j, &b, dst, next_pc);
+        } break;
+
+        case OP_STR: {
+            u16 offset6 = sext(inst & 0x3F, 6);
+            use_reg(j, &b, src);
+            emit_mov_ecx_reg(j, src);
+            // add ecx, imm32
+            emit8(j, 0x81); emit8(j, 0xC1); emit32(j, offset6);
+            emit_store(j, &b, dst, next_pc);
+        } break;
+
+        case OP_BR: {
+            u16 nzp = inst >> 9 & 0x7;
+            u16 taken = next_pc + sext(inst & 0x1FF, 9);
+            emit_br(j, &b, nzp, taken, next_pc);
+            is_done = 1;
+        } break;
+
+        case OP_JMP:
+            use_reg(j, &b, src);
+            emit_writeback(j, &b);
+            emit_set_pc_reg(j, src);
+            emit_exit(j, EXIT_PLAIN);
+            is_done = 1;
+            break;
+
+        case OP_JSR:
+            if (inst >> 11 & 0x1) {
+                clobber_reg(j, &b, R_R7);
+                emit8(j, 0x41); emit8(j, 0xB8 | R_R7); emit32(j, next_pc);
+                emit_writeback(j, &b);
+                emit_chain(j, next_pc + sext(inst & 0x7FF, 11));
+            } else {
+                use_reg(j, &b, src);
+                emit_set_pc_reg(j, src);
+                clobber_reg(j, &b, R_R7);
+                emit8(j, 0x41); emit8(j, 0xB8 | R_R7); emit32(j, next_pc);
+                emit_writeback(j, &b);
+                emit_exit(j, EXIT_PLAIN);
+            }
+            is_done = 1;
+            break;
+        }
+
+        pc = next_pc;
+    }
+
+    j->blocks[start] = block;
+    j->ranges[j->ranges_size++] = (struct block_range) {
+        .start = start,
+        .len = len
+    };
+
+    return block;
+}
+
+struct jit *jit_create(void)
+{
+    struct jit *j = calloc(1, sizeof(*j));
+    if (j == NULL) return NULL;
+
+    j->code = mmap(NULL, CODE_CAP, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) {
+        free(j);
+        return NULL;
+    }
+
+    j->p = j->code;
+    emit_trampoline(j);
+
+    return j;
+}
+
+void jit_destroy(struct jit *j)
+{
+    munmap(j->code, CODE_CAP);
+    free(j);
+}
+
+void jit_invalidate(struct jit *j, u16 addr)
+{
+    if (j->map[addr]) jit_flush(j);
+}
+
+// @NOTE(art): limits and checkpoints are checked here, chained blocks come
+// back when it is time (see emit_chain())
+int jit_run(struct lc3_vm *vm)
+{
+    struct jit *j = vm->jit;
+    u16 *regs = vm->regs;
+    u16 *memory = vm->memory;
+
+    for (;;) {
+        if (vm->instret >= vm->check_at) {
+            int status = check_limits(vm, 0);
+            if (status != LC3_RUNNING) return status;
+        }
+
+        u16 pc = regs[R_PC];
+        u16 inst = memory[pc];
+
+        switch (inst >> 12) {
+        case OP_TRAP:
+            vm->instret++;
+            regs[R_PC]++;
+            if (exec_trap(vm, inst & 0xFF)) return LC3_HALTED;
+            continue;
+
+        case OP_RTI:
+            vm->instret++;
+            regs[R_PC]++;
+            exec_rti(vm);
+            continue;
+
+        case OP_RESERVED:
+            return LC3_ILLEGAL;
+        }
+
+        unsigned char *block = j->blocks[pc];
+        if (block == NULL) block = compile(j, memory, pc);
+
+        uintptr_t r = j->enter(regs, memory, j->map, block);
+        if (r == EXIT_PLAIN) continue;
+        if (r == EXIT_SMC) {
+            jit_flush(j);
+            continue;
+        }
+
+        // @NOTE(art): chain request, `r` is jump site waiting for block at PC
+        pc = regs[R_PC];
+        u16 target_op = memory[pc] >> 12;
+        if (target_op == OP_TRAP || target_op == OP_RTI ||
+                target_op == OP_RESERVED) {
+            continue;
+        }
+
+        size_t generation = j->generation;
+        unsigned char *target = j->blocks[pc];
+        if (target == NULL) target = compile(j, memory, pc);
+        if (generation == j->generation) {
+            patch_rel32((unsigned char *) r, target);
+        }
+    }
+}
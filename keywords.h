@@ -0,0 +1,51 @@
+// @NOTE(art): generated by kwgen.c (./build.sh keywords), do not edit
+
+#define KEYWORDS_BITS 7
+#define KEYWORDS_MULT 0x30DC0585B614DE8Full
+
+static const struct keyword keywords[1 << KEYWORDS_BITS] = {
+    [0] = {0x7A676E697274732Eull, T_STRINGZ},
+    [1] = {0x0000000000003072ull, T_R0},
+    [2] = {0x000000000072646Cull, T_LDR},
+    [3] = {0x0000000000003772ull, T_R7},
+    [7] = {0x00000000006E7262ull, T_BRN},
+    [8] = {0x0000000000746572ull, T_RET},
+    [9] = {0x000000007272736Aull, T_JSRR},
+    [12] = {0x0000000000707262ull, T_BRP},
+    [13] = {0x0000000000727473ull, T_STR},
+    [14] = {0x006C61626F6C672Eull, T_GLOBAL},
+    [17] = {0x00000000746C6168ull, T_HALT},
+    [20] = {0x0000007073747570ull, T_PUTSP},
+    [21] = {0x0000000000003672ull, T_R6},
+    [24] = {0x00000000646E652Eull, T_EOF},
+    [26] = {0x0000000000646E61ull, T_AND},
+    [31] = {0x000000000074756Full, T_OUT},
+    [39] = {0x0000000000003572ull, T_R5},
+    [40] = {0x00000000007A7262ull, T_BRZ},
+    [41] = {0x0000000000706D6Aull, T_JMP},
+    [56] = {0x000000707A6E7262ull, T_BRNZP},
+    [57] = {0x0000000000003472ull, T_R4},
+    [64] = {0x0000000073747570ull, T_PUTS},
+    [65] = {0x000000000061656Cull, T_LEA},
+    [67] = {0x000000000072736Aull, T_JSR},
+    [70] = {0x00000000706E7262ull, T_BRNP},
+    [71] = {0x000000000000646Cull, T_LD},
+    [74] = {0x0000000000006E69ull, T_IN},
+    [75] = {0x0000000000003372ull, T_R3},
+    [78] = {0x0000000000646461ull, T_ADD},
+    [82] = {0x0000000000007473ull, T_ST},
+    [86] = {0x0000000063746567ull, T_GETC},
+    [87] = {0x0000000000007262ull, T_BR},
+    [90] = {0x0000000070617274ull, T_TRAP},
+    [92] = {0x0000000000697472ull, T_RTI},
+    [93] = {0x0000000000003272ull, T_R2},
+    [94] = {0x0000006769726F2Eull, T_ORIG},
+    [99] = {0x000000007A6E7262ull, T_BRNZ},
+    [104] = {0x00000000707A7262ull, T_BRZP},
+    [105] = {0x000000000069646Cull, T_LDI},
+    [110] = {0x000000776B6C622Eull, T_BLKW},
+    [111] = {0x0000000000003172ull, T_R1},
+    [114] = {0x0000000000746F6Eull, T_NOT},
+    [116] = {0x0000000000697473ull, T_STI},
+    [119] = {0x0000006C6C69662Eull, T_FILL},
+};
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// @NOTE(art): generates keywords.h for asm.c, run `./build.sh keywords`
+// after changing the list. Keyword is packed into uint64_t (first char in
+// the lowest byte, zero padded), slot is top bits of key * mult. We look for
+// a multiplier that sends every keyword to its own slot, so the scanner does
+// one multiply, one load and one compare per identifier.
+
+#define SLOTS_BITS 7
+#define SLOTS (1 << SLOTS_BITS)
+
+struct keyword {
+    const char *name;
+    const char *kind;
+};
+
+static const struct keyword keywords[] = {
+    {"r0", "T_R0"}, {"r1", "T_R1"}, {"r2", "T_R2"}, {"r3", "T_R3"},
+    {"r4", "T_R4"}, {"r5", "T_R5"}, {"r6", "T_R6"}, {"r7", "T_R7"},
+
+    {"br", "T_BR"}, {"brn", "T_BRN"}, {"brz", "T_BRZ"}, {"brp", "T_BRP"},
+    {"brnz", "T_BRNZ"}, {"brnp", "T_BRNP"}, {"brzp", "T_BRZP"},
+    {"brnzp", "T_BRNZP"},
+
+    {"add", "T_ADD"}, {"and", "T_AND"}, {"not", "T_NOT"},
+    {"ld", "T_LD"}, {"ldi", "T_LDI"}, {"ldr", "T_LDR"}, {"lea", "T_LEA"},
+    {"st", "T_ST"}, {"sti", "T_STI"}, {"str", "T_STR"},
+    {"jmp", "T_JMP"}, {"ret", "T_RET"}, {"jsr", "T_JSR"}, {"jsrr", "T_JSRR"},
+    {"rti", "T_RTI"}, {"trap", "T_TRAP"},
+
+    {"getc", "T_GETC"}, {"out", "T_OUT"}, {"puts", "T_PUTS"}, {"in", "T_IN"},
+    {"putsp", "T_PUTSP"}, {"halt", "T_HALT"},
+
+    {".orig", "T_ORIG"}, {".fill", "T_FILL"}, {".blkw", "T_BLKW"},
+    {".stringz", "T_STRINGZ"}, {".end", "T_EOF"}, {".global", "T_GLOBAL"}
+};
+
+#define KEYWORDS_SIZE (sizeof(keywords) / sizeof(keywords[0]))
+
+static uint64_t pack(const char *name)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; name[i]; ++i) key |= (uint64_t) name[i] << (i * 8);
+    return key;
+}
+
+// @NOTE(art): splitmix64, any decent sequence of odd numbers does
+static uint64_t next_mult(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (z ^ (z >> 31)) | 1;
+}
+
+int main(void)
+{
+    int slots[SLOTS];
+    uint64_t state = 0;
+    uint64_t mult;
+
+    for (;;) {
+        mult = next_mult(&state);
+        memset(slots, -1, sizeof(slots));
+
+        size_t i;
+        for (i = 0; i < KEYWORDS_SIZE; ++i) {
+            size_t slot = pack(keywords[i].name) * mult >> (64 - SLOTS_BITS);
+            if (slots[slot] >= 0) break;
+            slots[slot] = i;
+        }
+        if (i == KEYWORDS_SIZE) break;
+    }
+
+    printf("// @NOTE(art): generated by kwgen.c (./build.sh keywords), do not "
+            "edit\n\n");
+    printf("#define KEYWORDS_BITS %d\n", SLOTS_BITS);
+    printf("#define KEYWORDS_MULT 0x%016llXull\n\n", (unsigned long long) mult);
+    printf("static const struct keyword keywords[1 << KEYWORDS_BITS] = {\n");
+    for (size_t slot = 0; slot < SLOTS; ++slot) {
+        if (slots[slot] < 0) continue;
+        const struct keyword *k = keywords + slots[slot];
+        printf("    [%zu] = {0x%016llXull, %s},\n", slot,
+                (unsigned long long) pack(k->name), k->kind);
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -1,201 +1,897 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
-#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
 
 #include "lc3.h"
 
-#define MEMORY_CAP (1 << 16)
+#define PATH_CAP 4096
+
+struct job {
+    char obj[PATH_CAP];
+    char in[PATH_CAP];
+    char expected[PATH_CAP];
+};
+
+struct jobs_array {
+    size_t size;
+    size_t cap;
+    struct job *buf;
+};
+
+// @NOTE(art): job indices [head, tail) owned by one worker. Owner takes from
+// head, thieves take upper half from tail.
+struct deque {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+};
+
+struct worker {
+    pthread_t thread;
+    struct batch *batch;
+    struct deque queue;
+};
+
+// @NOTE(art): 0 is no limit, see lc3_vm_set_limits()
+struct limits {
+    size_t max_instret;
+    long max_wall_ms;
+};
 
-enum {
-    CC_P = 0x1,
-    CC_Z = 0x2,
-    CC_N = 0x4
+struct batch {
+    struct jobs_array *jobs;
+    struct worker *workers;
+    size_t workers_size;
+    size_t failed;
+    struct limits limits;
+    pthread_mutex_t report_lock;
 };
 
-static u16 regs[R_COUNT];
-static u16 memory[MEMORY_CAP];
+int read_manifest(const char *path, struct jobs_array *jobs)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    jobs->size = 0;
+    jobs->cap = 8;
+    if ((jobs->buf = malloc(jobs->cap * sizeof(struct job))) == NULL) {
+        perror("malloc");
+        fclose(f);
+        return -1;
+    }
+
+    char line[3 * PATH_CAP];
+    size_t line_nr = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_nr++;
+
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\n' || *p == '\0' || *p == '#') continue;
+
+        if (jobs->size == jobs->cap) {
+            jobs->cap *= 2;
+            jobs->buf = realloc(jobs->buf, jobs->cap * sizeof(struct job));
+            if (jobs->buf == NULL) {
+                perror("realloc");
+                fclose(f);
+                return -1;
+            }
+        }
+
+        struct job *j = jobs->buf + jobs->size;
+        if (sscanf(p, "%4095s %4095s %4095s", j->obj, j->in,
+                    j->expected) != 3) {
+            fprintf(stderr, "%s:%zu: expected `obj stdin expected`\n",
+                    path, line_nr);
+            fclose(f);
+            return -1;
+        }
+        jobs->size++;
+    }
 
-u16 sext(u16 value, size_t bit_len)
+    fclose(f);
+    return 0;
+}
+
+int take_job(struct deque *q, size_t *job)
 {
-    if (value >> (bit_len - 1) & 0x1) {
-        return 0xFFFF << bit_len | value;
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *job = q->head++;
+        found = 1;
     }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+size_t jobs_left(struct deque *q)
+{
+    pthread_mutex_lock(&q->lock);
+    size_t left = q->tail - q->head;
+    pthread_mutex_unlock(&q->lock);
+
+    return left;
+}
+
+// @NOTE(art): steal half of the fullest deque, so one long job at the end
+// of someone's range does not leave others idle
+int steal_jobs(struct worker *w)
+{
+    struct batch *b = w->batch;
+
+    for (;;) {
+        struct worker *victim = NULL;
+        size_t most = 0;
+
+        for (size_t i = 0; i < b->workers_size; ++i) {
+            struct worker *v = b->workers + i;
+            if (v == w) continue;
+
+            size_t left = jobs_left(&v->queue);
+            if (left > most) {
+                most = left;
+                victim = v;
+            }
+        }
+
+        if (victim == NULL) return 0;
+
+        // @NOTE(art): victim might have drained in the meantime, look again
+        pthread_mutex_lock(&victim->queue.lock);
+        size_t tail = victim->queue.tail;
+        size_t head = tail - (tail - victim->queue.head + 1) / 2;
+        victim->queue.tail = head;
+        pthread_mutex_unlock(&victim->queue.lock);
+
+        if (head == tail) continue;
+
+        pthread_mutex_lock(&w->queue.lock);
+        w->queue.head = head;
+        w->queue.tail = tail;
+        pthread_mutex_unlock(&w->queue.lock);
+
+        return 1;
+    }
+}
+
+// @NOTE(art): reads whole fd from the start into *buf reusing its allocation
+long read_whole(int fd, char **buf, size_t *cap)
+{
+    size_t len = 0;
+    for (;;) {
+        if (len == *cap) {
+            *cap = *cap ? *cap * 2 : 4096;
+            if ((*buf = realloc(*buf, *cap)) == NULL) return -1;
+        }
+
+        ssize_t n = pread(fd, *buf + len, *cap - len, len);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        len += n;
+    }
+
+    return len;
+}
 
-    return value;
+long read_whole_path(const char *path, char **buf, size_t *cap)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    long len = read_whole(fd, buf, cap);
+    close(fd);
+    return len;
 }
 
-void setcc(u16 value)
+void report(struct batch *b, size_t job, const char *status, long at)
 {
-    u16 nzp;
-    if (value == 0) {
-        nzp = CC_Z;
-    } else if (value >> 15) {
-        nzp = CC_N;
+    pthread_mutex_lock(&b->report_lock);
+    if (at >= 0) {
+        printf("%zu %s %s @%ld\n", job, status, b->jobs->buf[job].obj, at);
     } else {
-        nzp = CC_P;
+        printf("%zu %s %s\n", job, status, b->jobs->buf[job].obj);
+    }
+    fflush(stdout);
+    if (strcmp(status, "ok") != 0) b->failed++;
+    pthread_mutex_unlock(&b->report_lock);
+}
+
+struct output {
+    int fd;
+    char *got;
+    size_t got_cap;
+    char *expected;
+    size_t expected_cap;
+};
+
+// @NOTE(art): returns offset of the first difference against expected
+// output, -1 when it matches, -2 on error. Machine that did not halt is
+// -3 (illegal opcode), -4 (out of instructions) or -5 (out of time), its
+// output is not checked.
+long run_job(struct lc3_vm *vm, struct job *j, struct limits *limits,
+        struct output *out)
+{
+    lc3_vm_reset(vm);
+    if (ftruncate(out->fd, 0) < 0 || lseek(out->fd, 0, SEEK_SET) < 0) {
+        return -2;
+    }
+
+    const char *in = strcmp(j->in, "-") == 0 ? "/dev/null" : j->in;
+    if ((vm->in = fopen(in, "rb")) == NULL) return -2;
+
+    if (lc3_vm_load(vm, j->obj) < 0) {
+        fclose(vm->in);
+        return -2;
+    }
+
+    lc3_vm_set_limits(vm, limits->max_instret, limits->max_wall_ms);
+    int status = lc3_vm_run(vm);
+    fclose(vm->in);
+
+    switch (status) {
+    case LC3_ILLEGAL: return -3;
+    case LC3_OUT_OF_INSTRUCTIONS: return -4;
+    case LC3_OUT_OF_TIME: return -5;
     }
 
-    regs[R_PSR] = (regs[R_PSR] & 0x8000) | nzp;
+    if (strcmp(j->expected, "-") == 0) return -1;
+
+    long got = read_whole(out->fd, &out->got, &out->got_cap);
+    long want = read_whole_path(j->expected, &out->expected,
+            &out->expected_cap);
+    if (got < 0 || want < 0) return -2;
+
+    long at = 0;
+    while (at < got && at < want && out->got[at] == out->expected[at]) at++;
+
+    return at == got && at == want ? -1 : at;
 }
 
-// @TODO(art): proper object file loading
-// @TODO(art): init memory, PC, etc
-int main(void)
+void *worker_main(void *arg)
 {
-    FILE *f = fopen("out.obj", "rb");
-    if (f == NULL) {
-        perror("fopen");
+    struct worker *w = arg;
+
+    // @NOTE(art): one machine and output file per worker, reset per job
+    struct lc3_vm *vm = lc3_vm_create();
+    FILE *tmp = tmpfile();
+    struct output out = {0};
+
+    if (vm == NULL || tmp == NULL) {
+        perror("worker");
+        exit(1);
+    }
+
+    out.fd = fileno(tmp);
+    lc3_vm_set_output(vm, out.fd);
+
+    for (;;) {
+        size_t i;
+        if (!take_job(&w->queue, &i)) {
+            if (!steal_jobs(w)) break;
+            continue;
+        }
+
+        struct job *j = w->batch->jobs->buf + i;
+        long at = run_job(vm, j, &w->batch->limits, &out);
+        switch (at) {
+        case -5: report(w->batch, i, "timeout", -1); break;
+        case -4: report(w->batch, i, "budget", -1); break;
+        case -3: report(w->batch, i, "illegal", -1); break;
+        case -2: report(w->batch, i, "error", -1); break;
+        case -1: report(w->batch, i, "ok", -1); break;
+        default: report(w->batch, i, "fail", at);
+        }
+    }
+
+    fclose(tmp);
+    free(out.got);
+    free(out.expected);
+    lc3_vm_destroy(vm);
+    return NULL;
+}
+
+// @NOTE(art): manifest is one job per line: `obj stdin expected`, `-` for no
+// stdin or for not checking output. Prints `<job> ok|fail|error <obj>` per
+// job as it finishes, fail also has offset of the first differing byte.
+// Job stopped by illegal opcode or a limit is `illegal`, `budget` or
+// `timeout`, so a runaway program only costs its worker the limit.
+int run_batch(const char *manifest, struct limits *limits)
+{
+    // @LEAK(art): let OS free it
+    struct jobs_array jobs;
+    if (read_manifest(manifest, &jobs) < 0) return 1;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers_size = cpus > 0 ? (size_t) cpus : 1;
+    if (workers_size > jobs.size && jobs.size > 0) workers_size = jobs.size;
+
+    struct batch b = {
+        .jobs = &jobs,
+        .workers_size = workers_size,
+        .failed = 0,
+        .limits = *limits
+    };
+    pthread_mutex_init(&b.report_lock, NULL);
+
+    // @LEAK(art): let OS free it
+    if ((b.workers = calloc(workers_size, sizeof(struct worker))) == NULL) {
+        perror("calloc");
         return 1;
     }
 
-    fread(regs + R_PC, sizeof(u16), 1, f);
+    for (size_t i = 0; i < workers_size; ++i) {
+        struct worker *w = b.workers + i;
+        w->batch = &b;
+        pthread_mutex_init(&w->queue.lock, NULL);
+        w->queue.head = jobs.size * i / workers_size;
+        w->queue.tail = jobs.size * (i + 1) / workers_size;
+    }
 
-    u16 op;
-    size_t offset = regs[R_PC];
-    while (fread(&op, sizeof(op), 1, f) > 0) {
-        memory[offset++] = op;
+    for (size_t i = 0; i < workers_size; ++i) {
+        struct worker *w = b.workers + i;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
     }
 
-    int is_halted = 0;
-    while (!is_halted) {
-        u16 inst = memory[regs[R_PC]];
-        regs[R_PC]++;
-        u16 opcode = inst >> 12;
-        switch (opcode) {
-        case OP_ADD:
-        case OP_AND: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 src1 = inst >> 6 & 0x7;
-            u16 src2 = inst & 0x7;
+    for (size_t i = 0; i < workers_size; ++i) {
+        pthread_join(b.workers[i].thread, NULL);
+    }
 
-            if (inst >> 5 & 0x1) {
-                src2 = sext(inst & 0x1F, 5);
-            } else {
-                src2 = regs[src2];
-            }
+    return b.failed > 0;
+}
 
-            if (opcode == OP_ADD) {
-                regs[dst] = regs[src1] + src2;
-            } else {
-                regs[dst] = regs[src1] & src2;
-            }
+// @NOTE(art): user space cycle counter of this thread, -1 when perf events
+// are not available (containers, paranoid kernels, not linux)
+int cycles_open(void)
+{
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
 
-            setcc(regs[dst]);
-        } break;
+long long cycles_read(int fd)
+{
+    long long cycles;
+    if (fd < 0 || read(fd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+        return -1;
+    }
+    return cycles;
+}
 
-        case OP_BR: {
-            u16 nzp = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-            if ((nzp & CC_P) && (regs[R_PSR] & CC_P) ||
-                    (nzp & CC_Z) && (regs[R_PSR] & CC_Z) ||
-                    (nzp & CC_N) && (regs[R_PSR] & CC_N)) {
-                regs[R_PC] += pcoffset9;
-            }
-        } break;
+// @NOTE(art): goes to stderr so program output can be checked or thrown away
+// separately. One `key value` per line, bench/run.sh parses it.
+void print_stats(struct lc3_vm *vm, double seconds, long long cycles)
+{
+    fprintf(stderr, "instructions %zu\n", vm->instret);
+    fprintf(stderr, "seconds %.6f\n", seconds);
+    fprintf(stderr, "mips %.1f\n",
+            seconds > 0 ? vm->instret / seconds / 1e6 : 0.0);
+    if (cycles >= 0 && vm->instret > 0) {
+        fprintf(stderr, "cpi %.2f\n", (double) cycles / vm->instret);
+    } else {
+        fprintf(stderr, "cpi -\n");
+    }
+}
+
+// @NOTE(art): report goes to stderr, symbols are looked up in `prog.sym`
+// next to `prog.obj`. Returns enum lc3_status, -1 on error.
+int run_profile(struct lc3_vm *vm, const char *path)
+{
+    // @LEAK(art): let OS free it
+    struct lc3_profile *p = calloc(1, sizeof(*p));
+    char sym_path[PATH_CAP];
+    if (p == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    size_t len = strlen(path);
+    if (len >= 4 && strcmp(path + len - 4, ".obj") == 0) len -= 4;
+    snprintf(sym_path, sizeof(sym_path), "%.*s.sym", (int) len, path);
 
-        case OP_JMP: {
-            u16 base = inst >> 6 & 0x7;
-            regs[R_PC] = regs[base];
-        } break;
+    int status = lc3_profile_run(vm, p);
+    lc3_profile_report(vm, p, sym_path, stderr);
+    return status;
+}
 
-        case OP_JSR: {
-            regs[R_R7] = regs[R_PC];
+// @NOTE(art): exit code tells why machine stopped, 1 is left for usage and
+// load errors
+#define EXIT_ILLEGAL 2
+#define EXIT_OUT_OF_INSTRUCTIONS 3
+#define EXIT_OUT_OF_TIME 4
 
-            if (inst >> 11 & 0x1) {
-                u16 pcoffset11 = sext(inst & 0x7FF, 11);
-                regs[R_PC] += pcoffset11;
-            } else {
-                u16 base = inst >> 6 & 0x7;
-                regs[R_PC] = regs[base];
+int exit_code(struct lc3_vm *vm, int status, struct limits *limits)
+{
+    u16 pc = vm->regs[R_PC];
+    switch (status) {
+    case LC3_ILLEGAL:
+        fprintf(stderr, "illegal opcode x%04X at x%04X\n", vm->memory[pc], pc);
+        return EXIT_ILLEGAL;
+    case LC3_OUT_OF_INSTRUCTIONS:
+        fprintf(stderr, "out of instructions (%zu) at x%04X\n",
+                limits->max_instret, pc);
+        return EXIT_OUT_OF_INSTRUCTIONS;
+    case LC3_OUT_OF_TIME:
+        fprintf(stderr, "out of time (%ld ms) at x%04X\n",
+                limits->max_wall_ms, pc);
+        return EXIT_OUT_OF_TIME;
+    }
+    return 0;
+}
+
+const char *status_name(int status)
+{
+    switch (status) {
+    case LC3_HALTED: return "ok";
+    case LC3_ILLEGAL: return "illegal";
+    case LC3_OUT_OF_INSTRUCTIONS: return "budget";
+    case LC3_OUT_OF_TIME: return "timeout";
+    }
+    return "error";
+}
+
+// @NOTE(art): one run of `each`, input is read from the file, output goes to
+// `input.out`. Returns enum lc3_status, -1 on error.
+int run_input(struct lc3_vm *vm, const char *input, struct limits *limits)
+{
+    char out_path[PATH_CAP];
+    snprintf(out_path, sizeof(out_path), "%s.out", input);
+
+    FILE *in = fopen(input, "rb");
+    if (in == NULL) {
+        perror(input);
+        return -1;
+    }
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(out_path);
+        fclose(in);
+        return -1;
+    }
+
+    vm->in = in;
+    lc3_vm_set_output(vm, fd);
+    lc3_vm_set_limits(vm, limits->max_instret, limits->max_wall_ms);
+    int status = lc3_vm_run(vm);
+
+    vm->in = stdin;
+    lc3_vm_set_output(vm, STDOUT_FILENO);
+    close(fd);
+    fclose(in);
+    return status;
+}
+
+// @NOTE(art): every input starts from the state machine is in now. Child
+// processes get it through fork(), memory is shared copy-on-write until a
+// child writes to it. At most one child per CPU runs at a time.
+size_t run_forked(struct lc3_vm *vm, char **inputs, size_t size,
+        struct limits *limits)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_running = cpus > 0 ? (size_t) cpus : 1;
+    size_t running = 0, failed = 0;
+
+    // @LEAK(art): let OS free it
+    pid_t *pids = calloc(size, sizeof(pid_t));
+    if (pids == NULL) {
+        perror("calloc");
+        return size;
+    }
+
+    fflush(stdout);
+    for (size_t next = 0; next < size || running > 0;) {
+        if (next < size && running < max_running) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                int status = run_input(vm, inputs[next], limits);
+                _exit(status < 0 ? 255 : status);
             }
-        } break;
-
-        case OP_LD: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
-            regs[dst] = memory[regs[R_PC] + pcoffset9];
-            setcc(regs[dst]);
-        } break;
-
-        case OP_LDI: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
-            u16 addr = memory[regs[R_PC] + pcoffset9];
-            regs[dst] = memory[addr];
-            setcc(regs[dst]);
-        } break;
-
-        case OP_LDR: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 base = inst >> 6 & 0x7;
-            u16 offset6 = sext(inst & 0x2F, 6);
-            regs[dst] = memory[regs[base] + offset6];
-            setcc(regs[dst]);
-        } break;
-
-        case OP_LEA: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
-            regs[dst] = regs[R_PC] + pcoffset9;
-        } break;
-
-        case OP_NOT: {
-            u16 dst = inst >> 9 & 0x7;
-            u16 src = inst >> 6 & 0x7;
-            regs[dst] = ~regs[src];
-            setcc(regs[dst]);
-        } break;
-
-        case OP_RTI: {
-            regs[R_PC] = memory[regs[R_R6]];
-            regs[R_R6]++;
-            regs[R_PSR] = memory[regs[R_R6]];
-            regs[R_R6]++;
-        } break;
-
-        case OP_ST: {
-            u16 src = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
-            memory[regs[R_PC] + pcoffset9] = regs[src];
-        } break;
-
-        case OP_STI: {
-            u16 src = inst >> 9 & 0x7;
-            u16 pcoffset9 = sext(inst & 0x1FF, 9);
-            u16 addr = memory[regs[R_PC] + pcoffset9];
-            memory[addr] = regs[src];
-        } break;
-
-        case OP_STR: {
-            u16 src = inst >> 9 & 0x7;
-            u16 base = inst >> 6 & 0x7;
-            u16 offset6 = sext(inst & 0x2F, 6);
-            memory[regs[base] + offset6] = regs[src];
-        } break;
-
-        case OP_TRAP: {
-            u16 trapvec8 = inst & 0xFF;
-            switch (trapvec8) {
-            case 0x21: {
-                char c = regs[R_R0] & 0xFF;
-                putchar(c);
-            } break;
-            case 0x22: {
-                u16 addr = regs[R_R0];
-                while (memory[addr] != '\0') {
-                    putchar(memory[addr++]);
-                }
-            } break;
-            case 0x25:
-                is_halted = 1;
-                puts("lc3 is halted");
-                break;
+            if (pid < 0) {
+                perror("fork");
+                printf("%zu error %s\n", next, inputs[next]);
+                failed++;
+            } else {
+                pids[next] = pid;
+                running++;
             }
-        } break;
+            next++;
+            continue;
+        }
+
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) {
+            perror("wait");
+            return failed + running;
+        }
+        running--;
+
+        size_t i = 0;
+        while (pids[i] != pid) i++;
+        int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+        printf("%zu %s %s\n", i, status_name(status), inputs[i]);
+        fflush(stdout);
+        failed += status != LC3_HALTED;
+    }
+
+    return failed;
+}
+
+// @NOTE(art): `each`, program runs `warm` instructions first (boot, data
+// load, reading stdin), then once per input from that state: restored from
+// a snapshot in this process, or in a child per input with `is_fork`. Prints
+// `<n> ok|illegal|budget|timeout|error <input>` per input.
+int run_each(struct lc3_vm *vm, char **inputs, size_t size, size_t warm,
+        int is_fork, struct limits *limits)
+{
+    if (warm > 0) {
+        lc3_vm_set_limits(vm, warm, 0);
+        int status = lc3_vm_run(vm);
+        if (status != LC3_OUT_OF_INSTRUCTIONS) {
+            fprintf(stderr, "program stopped (%s) while warming up\n",
+                    status_name(status));
+            return 1;
+        }
+    }
+
+    if (is_fork) return run_forked(vm, inputs, size, limits) > 0;
+
+    // @LEAK(art): let OS free it
+    struct lc3_snapshot *snapshot = malloc(sizeof(*snapshot));
+    if (snapshot == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    lc3_vm_snapshot(vm, snapshot);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (i > 0) lc3_vm_restore(vm, snapshot);
+        int status = run_input(vm, inputs[i], limits);
+        printf("%zu %s %s\n", i, status_name(status), inputs[i]);
+        fflush(stdout);
+        failed += status != LC3_HALTED;
+    }
+
+    return failed > 0;
+}
+
+// @NOTE(art): assembled sources are cached as HASH.obj and HASH.sym in
+// $LC3_CACHE, $XDG_CACHE_HOME/lc3 or ~/.cache/lc3, with the whole source in
+// HASH.src. Hash only picks the entry, source has to match for a hit, so a
+// colliding (or crafted) source never runs another program's object. Bump
+// CACHE_VERSION when asm starts to emit something else for the same source.
+#define CACHE_VERSION 1
+
+// @NOTE(art): leaves room for the file name in PATH_CAP
+#define CACHE_DIR_CAP (PATH_CAP - 64)
+
+// @NOTE(art): FNV-1a, seeded with the version so old entries just miss
+uint64_t hash_source(const char *src, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull ^ CACHE_VERSION;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) src[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+int cache_dir(char *dir, size_t cap)
+{
+    const char *env;
+    int n;
+    if ((env = getenv("LC3_CACHE")) != NULL && *env) {
+        n = snprintf(dir, cap, "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+        n = snprintf(dir, cap, "%s/lc3", env);
+    } else if ((env = getenv("HOME")) != NULL && *env) {
+        n = snprintf(dir, cap, "%s/.cache/lc3", env);
+    } else {
+        return -1;
+    }
+    if (n < 0 || (size_t) n >= cap) return -1;
+
+    for (char *p = dir + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+int is_same_source(const char *path, const char *src, size_t len)
+{
+    char *buf = NULL;
+    size_t cap = 0;
+    long n = read_whole_path(path, &buf, &cap);
+    int is_same = n >= 0 && (size_t) n == len &&
+        (len == 0 || memcmp(buf, src, len) == 0);
+    free(buf);
+    return is_same;
+}
+
+int write_whole_path(const char *path, const char *buf, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            close(fd);
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return close(fd);
+}
+
+// @NOTE(art): written under temporary names and renamed, so concurrent runs
+// never see half an entry. Object goes last, it is what marks a hit. Source
+// is linked, never renamed over, so once there it stays what the object is
+// built from. Entry of another source with the same hash is left alone.
+// Returns -1 when nothing was stored.
+int cache_store(struct lc3_image *img, const char *dir, uint64_t hash,
+        const char *src, size_t len)
+{
+    char obj[PATH_CAP], sym[PATH_CAP], source[PATH_CAP];
+    char tmp_obj[PATH_CAP], tmp_sym[PATH_CAP], tmp_source[PATH_CAP];
+    unsigned long long h = hash;
+    int pid = getpid();
+    snprintf(obj, sizeof(obj), "%s/%016llx.obj", dir, h);
+    snprintf(sym, sizeof(sym), "%s/%016llx.sym", dir, h);
+    snprintf(source, sizeof(source), "%s/%016llx.src", dir, h);
+    snprintf(tmp_obj, sizeof(tmp_obj), "%s/%016llx.obj.%d", dir, h, pid);
+    snprintf(tmp_sym, sizeof(tmp_sym), "%s/%016llx.sym.%d", dir, h, pid);
+    snprintf(tmp_source, sizeof(tmp_source), "%s/%016llx.src.%d", dir, h,
+            pid);
+
+    int is_owned = write_whole_path(tmp_source, src, len) == 0 &&
+        (link(tmp_source, source) == 0 ||
+            (errno == EEXIST && is_same_source(source, src, len)));
+    unlink(tmp_source);
+    if (!is_owned) return -1;
+
+    if (lc3_image_write(img, tmp_obj, tmp_sym) < 0 ||
+            rename(tmp_sym, sym) < 0 || rename(tmp_obj, obj) < 0) {
+        unlink(tmp_obj);
+        unlink(tmp_sym);
+        return -1;
+    }
+    return 0;
+}
+
+// @NOTE(art): `lc3 run prog.asm`. Cached object is mapped like any other,
+// otherwise source is assembled straight into memory and stored for next
+// time. `obj_path` gets cached object for profiler's symbols, empty when
+// there is no cache or the entry could not be stored.
+int load_source(struct lc3_vm *vm, const char *path, char *obj_path,
+        int *is_hit)
+{
+    char *src = NULL;
+    size_t cap = 0;
+    long len = read_whole_path(path, &src, &cap);
+    if (len < 0) {
+        perror(path);
+        return -1;
+    }
 
-        default: fprintf(stderr, "opcode %4x not implemented\n", opcode);
+    uint64_t hash = hash_source(src, len);
+    char dir[CACHE_DIR_CAP];
+    int has_cache = cache_dir(dir, sizeof(dir)) == 0;
+
+    *is_hit = 0;
+    obj_path[0] = '\0';
+    if (has_cache) {
+        char source[PATH_CAP];
+        unsigned long long h = hash;
+        snprintf(obj_path, PATH_CAP, "%s/%016llx.obj", dir, h);
+        snprintf(source, sizeof(source), "%s/%016llx.src", dir, h);
+        if (access(obj_path, R_OK) == 0 &&
+                is_same_source(source, src, len) &&
+                lc3_vm_load(vm, obj_path) == 0) {
+            *is_hit = 1;
+            free(src);
+            return 0;
         }
     }
 
+    // @NOTE(art): linked on its own, so stray .external is reported
+    struct lc3_image mod = {0}, img = {0};
+    struct lc3_diag diags;
+    int err = lc3_assemble(src, len, &mod, &diags);
+    lc3_diag_print(&diags, path, stderr);
+    if (err) {
+        free(src);
+        return -1;
+    }
+
+    err = lc3_link(&mod, 1, &img, &diags);
+    lc3_image_free(&mod);
+    lc3_diag_print(&diags, path, stderr);
+    if (err) {
+        free(src);
+        return -1;
+    }
+
+    lc3_vm_load_words(vm, img.words, img.size);
+    if (has_cache && cache_store(&img, dir, hash, src, len) < 0) {
+        obj_path[0] = '\0';
+    }
+
+    free(src);
+    lc3_image_free(&img);
     return 0;
 }
+
+// @NOTE(art): instructions between checkpoints, a copy of at most 128KB
+// every few tenths of a second at interpreter speed
+#define CHECKPOINT_EVERY (1 << 26)
+
+// @TODO(art): init memory, PC, etc
+int main(int argc, char **argv)
+{
+    int arg = 1;
+    int stats = 0;
+    int profile = 0;
+    const char *manifest = NULL;
+    struct limits limits = {0};
+    size_t warm = 0;
+    int is_fork = 0;
+    const char *checkpoint = NULL;
+    const char *resume = NULL;
+    size_t checkpoint_every = CHECKPOINT_EVERY;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        int has_value = arg + 1 < argc;
+        if (strcmp(argv[arg], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[arg], "--batch") == 0 && has_value) {
+            manifest = argv[++arg];
+        } else if (strcmp(argv[arg], "--max-instructions") == 0 &&
+                has_value) {
+            limits.max_instret = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--max-wall-ms") == 0 && has_value) {
+            limits.max_wall_ms = strtol(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--warm") == 0 && has_value) {
+            warm = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--fork") == 0) {
+            is_fork = 1;
+        } else if (strcmp(argv[arg], "--checkpoint") == 0 && has_value) {
+            checkpoint = argv[++arg];
+        } else if (strcmp(argv[arg], "--checkpoint-every") == 0 &&
+                has_value) {
+            checkpoint_every = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--resume") == 0 && has_value) {
+            resume = argv[++arg];
+        } else {
+            break;
+        }
+    }
+
+    int is_run = arg < argc && strcmp(argv[arg], "run") == 0;
+    int is_each = arg < argc && strcmp(argv[arg], "each") == 0;
+    arg += is_run || is_each;
+
+    if ((argc - arg > 1 && !is_each) || (is_each && argc - arg < 2) ||
+            (is_run && arg == argc) ||
+            (arg < argc && argv[arg][0] == '-') ||
+            (manifest != NULL && (arg < argc || is_run || is_each)) ||
+            (resume != NULL && (arg < argc || checkpoint != NULL)) ||
+            ((checkpoint != NULL || resume != NULL) &&
+                (manifest != NULL || is_each)) ||
+            checkpoint_every == 0) {
+        fprintf(stderr, "usage: %s [options] [--checkpoint file] "
+                "[file.obj]\n"
+                "       %s [options] --resume file\n"
+                "       %s [options] run file.asm\n"
+                "       %s [limits] [--warm N] [--fork] each file.obj "
+                "input...\n"
+                "       %s [limits] --batch manifest\n"
+                "options: --stats --profile --checkpoint-every N and limits\n"
+                "limits: --max-instructions N --max-wall-ms MS\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    if (manifest != NULL) return run_batch(manifest, &limits);
+
+    // @LEAK(art): let OS free it
+    struct lc3_vm *vm = lc3_vm_create();
+    if (vm == NULL) {
+        perror("lc3_vm_create");
+        return 1;
+    }
+
+    const char *path = arg < argc ? argv[arg] : "out.obj";
+    char obj_path[PATH_CAP];
+    int is_hit = 0;
+    if (resume != NULL) {
+        if (lc3_vm_checkpoint_open(vm, resume, checkpoint_every, 1) < 0) {
+            return 1;
+        }
+        path = resume;
+    } else if (is_run) {
+        if (load_source(vm, path, obj_path, &is_hit) < 0) return 1;
+        path = obj_path;
+    } else if (lc3_vm_load(vm, path) < 0) {
+        return 1;
+    }
+
+    if (is_each) {
+        return run_each(vm, argv + arg + 1, argc - arg - 1, warm, is_fork,
+                &limits);
+    }
+
+    if (checkpoint != NULL &&
+            lc3_vm_checkpoint_open(vm, checkpoint, checkpoint_every, 0) < 0) {
+        return 1;
+    }
+
+    int cycles_fd = stats ? cycles_open() : -1;
+    double start = now();
+    lc3_vm_set_limits(vm, limits.max_instret, limits.max_wall_ms);
+
+    int status;
+    if (profile) {
+        if ((status = run_profile(vm, path)) < 0) return 1;
+    } else {
+        status = lc3_vm_run(vm);
+    }
+
+    // @NOTE(art): stopped by a limit, so --resume goes on from here
+    if (status == LC3_OUT_OF_INSTRUCTIONS || status == LC3_OUT_OF_TIME) {
+        lc3_vm_checkpoint(vm);
+    }
+
+    if (stats) print_stats(vm, now() - start, cycles_read(cycles_fd));
+    if (stats && is_run) fprintf(stderr, "cache %s\n", is_hit ? "hit" : "miss");
+
+    return exit_code(vm, status, &limits);
+}
@@ -1,6 +1,14 @@
 #ifndef LC3_H
 #define LC3_H
 
+#include <stddef.h>
+#include <stdio.h>
+
+#define MEMORY_CAP (1 << 16)
+#define MEMORY_PAGE 512
+#define MEMORY_PAGES (MEMORY_CAP / MEMORY_PAGE)
+#define OUT_CAP (1 << 16)
+
 typedef unsigned short u16;
 
 enum lc3_reg {
@@ -35,7 +43,230 @@ enum lc3_opcode {
     OP_JMP,
     OP_RESERVED,
     OP_LEA,
-    OP_TRAP // @TODO(art): not implemented
+    OP_TRAP
+};
+
+enum lc3_cc {
+    CC_P = 0x1,
+    CC_Z = 0x2,
+    CC_N = 0x4
+};
+
+// @NOTE(art): instruction predecoded once, so hot loops skip field extraction
+// and sign extension. `handler` is opcode specialized by its mode bits (see
+// enum handler in vm.c), `imm` is already sign extended (or SR2 for register
+// ADD/AND).
+struct lc3_decoded {
+    unsigned char handler;
+    unsigned char dst;
+    unsigned char src;
+    u16 imm;
+};
+
+struct jit;
+struct lc3_snapshot;
+struct lc3_checkpoint;
+
+// @NOTE(art): page bits in lc3_vm's `dirty`. Page is written since last reset
+// (so it may not be all zero), since last snapshot taken or restored (so
+// restore has to copy it back) and since last checkpoint (so it goes to the
+// file). Every write sets all of them with one store.
+enum lc3_dirty {
+    DIRTY_RESET = 0x1,
+    DIRTY_SNAPSHOT = 0x2,
+    DIRTY_CHECKPOINT = 0x4,
+    DIRTY_ALL = DIRTY_RESET | DIRTY_SNAPSHOT | DIRTY_CHECKPOINT
+};
+
+// @NOTE(art): why lc3_vm_run() returned, lc3_vm_step() gives LC3_RUNNING
+// when machine can go on. Illegal opcode is not retired, PC points at it.
+enum lc3_status {
+    LC3_RUNNING = 0,
+    LC3_HALTED,
+    LC3_ILLEGAL,
+    LC3_OUT_OF_INSTRUCTIONS,
+    LC3_OUT_OF_TIME
+};
+
+// @NOTE(art): whole machine state, nothing in vm.c is global so any number
+// of machines can live in one process. Console reads `in` (stdin after
+// create) and writes buffered output to fd set by lc3_vm_set_output().
+// `instret` counts retired instructions since last reset. Limits are set by
+// lc3_vm_set_limits(), `check_at` is instret where they are looked at next.
+// `dirty` has bits per page (see enum lc3_dirty), `snapshot` is the one
+// they are relative to. `checkpoint` is the file state goes to, if any.
+struct lc3_vm {
+    u16 regs[R_COUNT];
+    u16 memory[MEMORY_CAP];
+    struct lc3_decoded decoded[MEMORY_CAP];
+    unsigned char dirty[MEMORY_PAGES];
+    const struct lc3_snapshot *snapshot;
+    struct lc3_checkpoint *checkpoint;
+    struct jit *jit;
+    size_t instret;
+    size_t max_instret;
+    long long deadline;
+    size_t check_at;
+    FILE *in;
+    int out_fd;
+    int out_tty;
+    size_t out_size;
+    char out_buf[OUT_CAP];
+};
+
+struct lc3_vm *lc3_vm_create(void);
+void lc3_vm_destroy(struct lc3_vm *vm);
+void lc3_vm_reset(struct lc3_vm *vm);
+int lc3_vm_load(struct lc3_vm *vm, const char *path);
+void lc3_vm_load_words(struct lc3_vm *vm, const u16 *words, size_t size);
+int lc3_vm_step(struct lc3_vm *vm);
+int lc3_vm_run(struct lc3_vm *vm);
+void lc3_vm_set_limits(struct lc3_vm *vm, size_t max_instret,
+        long max_wall_ms);
+void lc3_vm_set_output(struct lc3_vm *vm, int fd);
+void lc3_vm_flush(struct lc3_vm *vm);
+
+// @NOTE(art): machine state to come back to, any number of times. Restore
+// copies back only pages written since, see lc3_vm_restore(). `owner` is
+// the machine that took it last.
+struct lc3_snapshot {
+    const struct lc3_vm *owner;
+    u16 regs[R_COUNT];
+    u16 memory[MEMORY_CAP];
+    struct lc3_decoded decoded[MEMORY_CAP];
+    unsigned char dirty[MEMORY_PAGES];
+    size_t instret;
+    long in_offset;
+};
+
+void lc3_vm_snapshot(struct lc3_vm *vm, struct lc3_snapshot *s);
+void lc3_vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *s);
+
+// @NOTE(art): state goes to mapped file every `every` instructions, see
+// vm.c. With `is_resume` machine is first put back to newest state in the
+// file, instead of being loaded.
+int lc3_vm_checkpoint_open(struct lc3_vm *vm, const char *path, size_t every,
+        int is_resume);
+void lc3_vm_checkpoint(struct lc3_vm *vm);
+
+u16 sext(u16 value, size_t bit_len);
+int exec_trap(struct lc3_vm *vm, u16 trapvec8);
+void exec_rti(struct lc3_vm *vm);
+int check_limits(struct lc3_vm *vm, size_t instret);
+int fuse_len(const u16 *memory, u16 addr);
+
+// @NOTE(art): per PC execution counts and taken count per BR (see prof.c).
+// Report maps addresses to labels and lines when asm's .sym file is given.
+struct lc3_profile {
+    size_t count[MEMORY_CAP];
+    size_t taken[MEMORY_CAP];
 };
 
+int lc3_profile_run(struct lc3_vm *vm, struct lc3_profile *p);
+void lc3_profile_report(struct lc3_vm *vm, struct lc3_profile *p,
+        const char *sym_path, FILE *out);
+
+// @NOTE(art): assembler (see asm.c), asm binary is a thin wrapper around it
+// in asmcli.c. Nothing in it is global, so any number of threads can
+// assemble at once. All memory comes from image's `alloc` (libc when left
+// zeroed) and belongs to the image until lc3_image_free().
+struct lc3_allocator {
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+
+enum lc3_scope {
+    LC3_LOCAL = 0,
+    LC3_GLOBAL,
+    LC3_EXTERNAL
+};
+
+struct lc3_label {
+    const char *name;
+    size_t len;
+    u16 addr;
+    unsigned char scope;
+};
+
+// @NOTE(art): word at `at` (index into words) needs address of `label`
+// (index into labels): PC relative offset in low 9 or 11 bits or whole word
+enum lc3_reloc_kind {
+    LC3_RELOC_PC9 = 0,
+    LC3_RELOC_PC11,
+    LC3_RELOC_ABS16
+};
+
+struct lc3_reloc {
+    size_t at;
+    size_t label;
+    unsigned char kind;
+};
+
+// @NOTE(art): `words` is origin and then the program, in host order. Module
+// without .orig is relocatable, assembled as if at x3000. Externals are
+// labels with addr 0. Relocations are what lc3_link() has to patch when the
+// module moves or uses externals. Labels and source line of every emitted
+// address are what goes to .sym file.
+struct lc3_image {
+    struct lc3_allocator alloc;
+    u16 *words;
+    size_t size;
+    int is_absolute;
+    struct lc3_label *labels;
+    size_t labels_size;
+    char *names;
+    struct lc3_reloc *relocs;
+    size_t relocs_size;
+    u16 *line_addr;
+    unsigned *line_nr;
+    size_t lines_size;
+};
+
+#define LC3_DIAG_CAP 32
+#define LC3_DIAG_AT_CAP 32
+
+// @NOTE(art): errors of one assembly or link. `count` is all of them, only
+// first LC3_DIAG_CAP are kept. `at` is the offending token (or symbol) cut
+// to fit, empty when error is not about one. Link errors have no line.
+struct lc3_diag_entry {
+    size_t line;
+    char at[LC3_DIAG_AT_CAP];
+    const char *msg;
+};
+
+struct lc3_diag {
+    size_t count;
+    struct lc3_diag_entry buf[LC3_DIAG_CAP];
+};
+
+// @NOTE(art): 0 and filled image on success, -1 and empty image when there
+// were errors. _fd variant streams source from fd, --lex only scans it and
+// returns number of tokens.
+int lc3_assemble(const char *src, size_t len, struct lc3_image *out,
+        struct lc3_diag *diags);
+int lc3_assemble_fd(int fd, struct lc3_image *out, struct lc3_diag *diags);
+void lc3_image_free(struct lc3_image *img);
+struct lc3_allocator lc3_image_allocator(struct lc3_image *img);
+int lc3_image_write(struct lc3_image *img, const char *obj_path,
+        const char *sym_path);
+void lc3_diag_print(struct lc3_diag *diags, const char *path, FILE *out);
+long lc3_lex_fd(int fd, size_t *bytes, struct lc3_diag *diags);
+
+// @NOTE(art): linker and relocatable objects (see link.c). Modules are laid
+// out in order, relocatable ones right after the previous module (first one
+// at x3000), absolute ones at their origin. Program starts at the first
+// module, nothing may go below it or overlap.
+int lc3_link(struct lc3_image *mods, size_t size, struct lc3_image *out,
+        struct lc3_diag *diags);
+int lc3_image_write_rel(struct lc3_image *img, const char *path);
+int lc3_image_read_rel(struct lc3_image *img, const char *path);
+
+// @NOTE(art): x86-64 translator, only built with LC3_JIT (see jit.c)
+struct jit *jit_create(void);
+void jit_destroy(struct jit *j);
+void jit_flush(struct jit *j);
+void jit_invalidate(struct jit *j, u16 addr);
+int jit_run(struct lc3_vm *vm);
+
 #endif
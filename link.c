@@ -0,0 +1,593 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lc3.h"
+
+// @NOTE(art): relocatable object, all fields little endian:
+//
+//     "LC3R" u16 version, u16 flags (bit 0: absolute)
+//     u32 words, u32 labels, u32 relocs, u32 lines, u32 names
+//     words   u16, origin first
+//     labels  u32 name (offset into names), u16 len, u16 addr, u8 scope
+//     relocs  u32 at, u32 label, u8 kind
+//     lines   u16 addr, u32 source line
+//     names   bytes
+//
+// asm allows only one .orig, so a module is a single section and the flags
+// and origin word describe all of it.
+
+#define REL_MAGIC "LC3R"
+#define REL_VERSION 1
+#define REL_HEADER (4 + 2 + 2 + 5 * 4)
+#define REL_LABEL (4 + 2 + 2 + 1)
+#define REL_RELOC (4 + 4 + 1)
+#define REL_LINE (2 + 4)
+
+struct bytes {
+    unsigned char *p;
+    unsigned char *end;
+};
+
+static void put16(struct bytes *b, u16 v)
+{
+    b->p[0] = v;
+    b->p[1] = v >> 8;
+    b->p += 2;
+}
+
+static void put32(struct bytes *b, uint32_t v)
+{
+    put16(b, v);
+    put16(b, v >> 16);
+}
+
+// @NOTE(art): reads past the end give zeros, caller checks b->p <= b->end
+// once at the end
+static u16 get16(struct bytes *b)
+{
+    u16 v = 0;
+    if (b->end - b->p >= 2) v = b->p[0] | b->p[1] << 8;
+    b->p += 2;
+    return v;
+}
+
+static uint32_t get32(struct bytes *b)
+{
+    uint32_t lo = get16(b);
+    return lo | (uint32_t) get16(b) << 16;
+}
+
+static unsigned char get8(struct bytes *b)
+{
+    unsigned char v = b->p < b->end ? *b->p : 0;
+    b->p++;
+    return v;
+}
+
+int lc3_image_write_rel(struct lc3_image *img, const char *path)
+{
+    size_t names = 0;
+    for (size_t i = 0; i < img->labels_size; ++i) names += img->labels[i].len;
+
+    size_t size = REL_HEADER + img->size * 2 + img->labels_size * REL_LABEL +
+        img->relocs_size * REL_RELOC + img->lines_size * REL_LINE + names;
+
+    unsigned char *buf = malloc(size);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    struct bytes b = {buf, buf + size};
+    memcpy(b.p, REL_MAGIC, 4);
+    b.p += 4;
+    put16(&b, REL_VERSION);
+    put16(&b, img->is_absolute ? 1 : 0);
+    put32(&b, img->size);
+    put32(&b, img->labels_size);
+    put32(&b, img->relocs_size);
+    put32(&b, img->lines_size);
+    put32(&b, names);
+
+    for (size_t i = 0; i < img->size; ++i) put16(&b, img->words[i]);
+
+    uint32_t name = 0;
+    for (size_t i = 0; i < img->labels_size; ++i) {
+        struct lc3_label *l = img->labels + i;
+        put32(&b, name);
+        put16(&b, l->len);
+        put16(&b, l->addr);
+        *b.p++ = l->scope;
+        name += l->len;
+    }
+    for (size_t i = 0; i < img->relocs_size; ++i) {
+        struct lc3_reloc *r = img->relocs + i;
+        put32(&b, r->at);
+        put32(&b, r->label);
+        *b.p++ = r->kind;
+    }
+    for (size_t i = 0; i < img->lines_size; ++i) {
+        put16(&b, img->line_addr[i]);
+        put32(&b, img->line_nr[i]);
+    }
+    for (size_t i = 0; i < img->labels_size; ++i) {
+        memcpy(b.p, img->labels[i].name, img->labels[i].len);
+        b.p += img->labels[i].len;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        free(buf);
+        return -1;
+    }
+
+    unsigned char *p = buf;
+    size_t left = size;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            perror("write");
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+
+    free(buf);
+    if (close(fd) < 0) {
+        perror("close");
+        return -1;
+    }
+    return left == 0 ? 0 : -1;
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    unsigned char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (buf == NULL) {
+        perror("malloc");
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = 0;
+    while (len < (size_t) st.st_size) {
+        ssize_t n = read(fd, buf + len, st.st_size - len);
+        if (n <= 0) {
+            if (n < 0) perror("read");
+            break;
+        }
+        len += n;
+    }
+
+    close(fd);
+    *size = len;
+    return buf;
+}
+
+int lc3_image_read_rel(struct lc3_image *img, const char *path)
+{
+    struct lc3_allocator alloc = lc3_image_allocator(img);
+    struct lc3_allocator keep = img->alloc;
+    memset(img, 0, sizeof(*img));
+    img->alloc = keep;
+
+    size_t size;
+    unsigned char *buf = read_file(path, &size);
+    if (buf == NULL) return -1;
+
+    struct bytes b = {buf, buf + size};
+    if (size < REL_HEADER || memcmp(buf, REL_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a relocatable object\n", path);
+        free(buf);
+        return -1;
+    }
+    b.p += 4;
+
+    u16 version = get16(&b);
+    u16 flags = get16(&b);
+    size_t words = get32(&b);
+    size_t labels = get32(&b);
+    size_t relocs = get32(&b);
+    size_t lines = get32(&b);
+    size_t names = get32(&b);
+
+    size_t want = REL_HEADER + words * 2 + labels * REL_LABEL +
+        relocs * REL_RELOC + lines * REL_LINE + names;
+    if (version != REL_VERSION || want != size || words > MEMORY_CAP + 1) {
+        fprintf(stderr, "%s: bad relocatable object\n", path);
+        free(buf);
+        return -1;
+    }
+
+    img->is_absolute = flags & 1;
+    img->words = alloc.realloc(alloc.ctx, NULL, (words + 1) * sizeof(u16));
+    img->labels = alloc.realloc(alloc.ctx, NULL,
+            (labels + 1) * sizeof(struct lc3_label));
+    img->relocs = alloc.realloc(alloc.ctx, NULL,
+            (relocs + 1) * sizeof(struct lc3_reloc));
+    img->line_addr = alloc.realloc(alloc.ctx, NULL, (lines + 1) * sizeof(u16));
+    img->line_nr = alloc.realloc(alloc.ctx, NULL,
+            (lines + 1) * sizeof(unsigned));
+    img->names = alloc.realloc(alloc.ctx, NULL, names + 1);
+    if (!img->words || !img->labels || !img->relocs || !img->line_addr ||
+            !img->line_nr || !img->names) {
+        perror("realloc");
+        lc3_image_free(img);
+        free(buf);
+        return -1;
+    }
+
+    int is_bad = 0;
+    unsigned char *names_at = buf + size - names;
+    memcpy(img->names, names_at, names);
+
+    img->size = words;
+    for (size_t i = 0; i < words; ++i) img->words[i] = get16(&b);
+
+    img->labels_size = labels;
+    for (size_t i = 0; i < labels; ++i) {
+        struct lc3_label *l = img->labels + i;
+        size_t name = get32(&b);
+        l->len = get16(&b);
+        l->addr = get16(&b);
+        l->scope = get8(&b);
+        l->name = img->names + name;
+        is_bad |= name + l->len > names || l->scope > LC3_EXTERNAL;
+    }
+
+    img->relocs_size = relocs;
+    for (size_t i = 0; i < relocs; ++i) {
+        struct lc3_reloc *r = img->relocs + i;
+        r->at = get32(&b);
+        r->label = get32(&b);
+        r->kind = get8(&b);
+        is_bad |= r->at == 0 || r->at >= words || r->label >= labels ||
+            r->kind > LC3_RELOC_ABS16;
+    }
+
+    img->lines_size = lines;
+    for (size_t i = 0; i < lines; ++i) {
+        img->line_addr[i] = get16(&b);
+        img->line_nr[i] = get32(&b);
+    }
+
+    free(buf);
+    if (is_bad) {
+        fprintf(stderr, "%s: bad relocatable object\n", path);
+        lc3_image_free(img);
+        return -1;
+    }
+    return 0;
+}
+
+static void report(struct lc3_diag *diags, const char *at, size_t len,
+        const char *msg)
+{
+    if (diags->count < LC3_DIAG_CAP) {
+        struct lc3_diag_entry *e = diags->buf + diags->count;
+        if (len > LC3_DIAG_AT_CAP - 1) len = LC3_DIAG_AT_CAP - 1;
+        e->line = 0;
+        memcpy(e->at, at, len);
+        e->at[len] = '\0';
+        e->msg = msg;
+    }
+    diags->count++;
+}
+
+// @NOTE(art): FNV-1a, same as asm's label table
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// @NOTE(art): open addressing, `mod` is module index + 1 (0 is empty)
+struct global {
+    uint32_t mod;
+    uint32_t label;
+    uint32_t hash;
+};
+
+struct link {
+    struct lc3_allocator alloc;
+    struct lc3_diag *diags;
+    struct lc3_image *mods;
+    size_t size;
+    size_t *base;
+    struct global *globals;
+    size_t globals_cap;
+};
+
+struct span {
+    size_t base;
+    size_t end;
+};
+
+static int span_cmp(const void *a, const void *b)
+{
+    const struct span *x = a, *y = b;
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+static void *take(struct link *l, size_t size)
+{
+    void *p = l->alloc.realloc(l->alloc.ctx, NULL, size ? size : 1);
+    if (p == NULL) report(l->diags, "", 0, "out of memory");
+    return p;
+}
+
+static void drop(struct link *l, void *p)
+{
+    if (p != NULL) l->alloc.free(l->alloc.ctx, p);
+}
+
+static size_t module_len(struct lc3_image *m)
+{
+    return m->size ? m->size - 1 : 0;
+}
+
+// @NOTE(art): address the label ends up at, module was assembled as if it
+// was at its origin word
+static u16 final_addr(struct link *l, size_t mod, size_t label)
+{
+    struct lc3_image *m = l->mods + mod;
+    u16 origin = m->size ? m->words[0] : 0x3000;
+    return l->base[mod] + (u16) (m->labels[label].addr - origin);
+}
+
+static struct global *find_global(struct link *l, const char *name,
+        size_t len, uint32_t hash)
+{
+    size_t mask = l->globals_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct global *g = l->globals + i;
+        if (g->mod == 0) return g;
+
+        struct lc3_label *other = l->mods[g->mod - 1].labels + g->label;
+        if (g->hash == hash && other->len == len &&
+                memcmp(other->name, name, len) == 0) {
+            return g;
+        }
+    }
+}
+
+static int layout(struct link *l)
+{
+    struct span *spans = take(l, l->size * sizeof(struct span));
+    if (spans == NULL) return -1;
+
+    size_t cursor = 0x3000;
+    for (size_t i = 0; i < l->size; ++i) {
+        struct lc3_image *m = l->mods + i;
+        l->base[i] = m->is_absolute && m->size ? m->words[0] : cursor;
+        cursor = l->base[i] + module_len(m);
+        spans[i] = (struct span) {l->base[i], cursor};
+
+        if (cursor > MEMORY_CAP) {
+            report(l->diags, "", 0, "module does not fit in memory");
+        }
+    }
+
+    qsort(spans, l->size, sizeof(struct span), span_cmp);
+    for (size_t i = 0; i < l->size; ++i) {
+        if (spans[i].base == spans[i].end) continue;
+        if (spans[i].base < l->base[0]) {
+            report(l->diags, "", 0, "module below the first one");
+        }
+        if (i + 1 < l->size && spans[i].end > spans[i + 1].base) {
+            report(l->diags, "", 0, "modules overlap");
+        }
+    }
+
+    drop(l, spans);
+    return l->diags->count ? -1 : 0;
+}
+
+static int collect_globals(struct link *l)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < l->size; ++i) {
+        for (size_t j = 0; j < l->mods[i].labels_size; ++j) {
+            count += l->mods[i].labels[j].scope == LC3_GLOBAL;
+        }
+    }
+
+    l->globals_cap = 16;
+    while (l->globals_cap < count * 2) l->globals_cap *= 2;
+    l->globals = take(l, l->globals_cap * sizeof(struct global));
+    if (l->globals == NULL) return -1;
+    memset(l->globals, 0, l->globals_cap * sizeof(struct global));
+
+    for (size_t i = 0; i < l->size; ++i) {
+        struct lc3_image *m = l->mods + i;
+        for (size_t j = 0; j < m->labels_size; ++j) {
+            struct lc3_label *label = m->labels + j;
+            if (label->scope != LC3_GLOBAL) continue;
+
+            uint32_t hash = hash_name(label->name, label->len);
+            struct global *g = find_global(l, label->name, label->len, hash);
+            if (g->mod != 0) {
+                report(l->diags, label->name, label->len,
+                        "global label defined twice");
+                continue;
+            }
+            *g = (struct global) {i + 1, j, hash};
+        }
+    }
+
+    return l->diags->count ? -1 : 0;
+}
+
+static void relocate(struct link *l, struct lc3_image *out, size_t mod)
+{
+    struct lc3_image *m = l->mods + mod;
+    u16 lo = out->words[0];
+
+    for (size_t i = 0; i < m->relocs_size; ++i) {
+        struct lc3_reloc *r = m->relocs + i;
+        struct lc3_label *label = m->labels + r->label;
+
+        u16 target;
+        if (label->scope == LC3_EXTERNAL) {
+            uint32_t hash = hash_name(label->name, label->len);
+            struct global *g = find_global(l, label->name, label->len, hash);
+            if (g->mod == 0) {
+                report(l->diags, label->name, label->len, "undefined symbol");
+                continue;
+            }
+            target = final_addr(l, g->mod - 1, g->label);
+        } else {
+            target = final_addr(l, mod, r->label);
+        }
+
+        u16 addr = l->base[mod] + r->at - 1;
+        u16 *word = out->words + (u16) (addr - lo) + 1;
+        int offset = (int16_t) (u16) (target - (addr + 1));
+
+        switch (r->kind) {
+        case LC3_RELOC_PC9:
+            if (offset < -256 || offset > 255) {
+                report(l->diags, label->name, label->len,
+                        "offset out of range");
+            }
+            *word = (*word & ~0x1FF) | (offset & 0x1FF);
+            break;
+        case LC3_RELOC_PC11:
+            if (offset < -1024 || offset > 1023) {
+                report(l->diags, label->name, label->len,
+                        "offset out of range");
+            }
+            *word = (*word & ~0x7FF) | (offset & 0x7FF);
+            break;
+        case LC3_RELOC_ABS16:
+            *word = target;
+            break;
+        }
+    }
+}
+
+// @NOTE(art): words of all modules in one image, labels (but externals) and
+// lines moved to final addresses, then relocations patched in place
+static int merge(struct link *l, struct lc3_image *out)
+{
+    size_t hi = l->base[0], labels = 0, names = 0, lines = 0;
+    for (size_t i = 0; i < l->size; ++i) {
+        struct lc3_image *m = l->mods + i;
+        size_t end = l->base[i] + module_len(m);
+        if (end > hi) hi = end;
+
+        for (size_t j = 0; j < m->labels_size; ++j) {
+            if (m->labels[j].scope == LC3_EXTERNAL) continue;
+            labels++;
+            names += m->labels[j].len;
+        }
+        lines += m->lines_size;
+    }
+
+    out->size = hi - l->base[0] + 1;
+    out->is_absolute = 1;
+    out->words = take(l, out->size * sizeof(u16));
+    out->labels = take(l, labels * sizeof(struct lc3_label));
+    out->names = take(l, names);
+    out->line_addr = take(l, lines * sizeof(u16));
+    out->line_nr = take(l, lines * sizeof(unsigned));
+    if (!out->words || !out->labels || !out->names || !out->line_addr ||
+            !out->line_nr) {
+        return -1;
+    }
+
+    u16 lo = l->base[0];
+    memset(out->words, 0, out->size * sizeof(u16));
+    out->words[0] = lo;
+
+    char *name = out->names;
+    for (size_t i = 0; i < l->size; ++i) {
+        struct lc3_image *m = l->mods + i;
+        u16 origin = m->size ? m->words[0] : 0x3000;
+        u16 delta = l->base[i] - origin;
+
+        memcpy(out->words + (l->base[i] - lo) + 1, m->words + 1,
+                module_len(m) * sizeof(u16));
+
+        for (size_t j = 0; j < m->labels_size; ++j) {
+            struct lc3_label *label = m->labels + j;
+            if (label->scope == LC3_EXTERNAL) continue;
+
+            memcpy(name, label->name, label->len);
+            out->labels[out->labels_size++] = (struct lc3_label) {
+                .name = name,
+                .len = label->len,
+                .addr = final_addr(l, i, j),
+                .scope = label->scope
+            };
+            name += label->len;
+        }
+
+        for (size_t j = 0; j < m->lines_size; ++j) {
+            out->line_addr[out->lines_size] = m->line_addr[j] + delta;
+            out->line_nr[out->lines_size] = m->line_nr[j];
+            out->lines_size++;
+        }
+    }
+
+    for (size_t i = 0; i < l->size; ++i) relocate(l, out, i);
+    return l->diags->count ? -1 : 0;
+}
+
+int lc3_link(struct lc3_image *mods, size_t size, struct lc3_image *out,
+        struct lc3_diag *diags)
+{
+    struct link l = {
+        .alloc = lc3_image_allocator(out),
+        .diags = diags,
+        .mods = mods,
+        .size = size
+    };
+
+    struct lc3_allocator keep = out->alloc;
+    memset(out, 0, sizeof(*out));
+    out->alloc = keep;
+    diags->count = 0;
+
+    if (size == 0) {
+        report(diags, "", 0, "nothing to link");
+        return -1;
+    }
+
+    int err = (l.base = take(&l, size * sizeof(size_t))) == NULL ||
+        layout(&l) < 0 || collect_globals(&l) < 0 || merge(&l, out) < 0;
+
+    drop(&l, l.base);
+    drop(&l, l.globals);
+    if (err) {
+        lc3_image_free(out);
+        return -1;
+    }
+    return 0;
+}
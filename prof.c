@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+
+// @NOTE(art): profiling runs its own loop over lc3_vm_step(), so normal runs
+// (and the JIT) do not pay anything for it. PSR is synced after every step,
+// which is what tells whether the next BR is taken.
+
+#define REPORT_TOP 20
+#define CACHE_LINE 64
+#define FORMS 32
+#define DECODE_LINES (MEMORY_CAP * sizeof(struct lc3_decoded) / CACHE_LINE)
+#define SYMBOL_NAME_CAP 64
+
+struct symbol {
+    u16 addr;
+    char name[SYMBOL_NAME_CAP];
+};
+
+struct symbols {
+    size_t size;
+    size_t cap;
+    struct symbol *buf;
+    size_t lines[MEMORY_CAP];
+};
+
+struct hot {
+    u16 addr;
+    u16 end;
+    size_t weight;
+};
+
+int lc3_profile_run(struct lc3_vm *vm, struct lc3_profile *p)
+{
+    int status;
+    for (;;) {
+        u16 pc = vm->regs[R_PC];
+        u16 inst = vm->memory[pc];
+
+        p->count[pc]++;
+        if (inst >> 12 == OP_BR && (inst >> 9 & 0x7 & vm->regs[R_PSR])) {
+            p->taken[pc]++;
+        }
+
+        if ((status = lc3_vm_step(vm)) != LC3_RUNNING) break;
+    }
+
+    lc3_vm_flush(vm);
+    return status;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int hot_cmp(const void *a, const void *b)
+{
+    const struct hot *x = a, *y = b;
+    return (x->weight < y->weight) - (x->weight > y->weight);
+}
+
+// @NOTE(art): symbol file is written by asm next to the object, lines are
+// `label xADDR name` and `line xADDR source_line`
+static struct symbols *read_symbols(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return NULL;
+
+    struct symbols *syms = calloc(1, sizeof(*syms));
+    if (syms == NULL) {
+        perror("calloc");
+        fclose(f);
+        return NULL;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned addr;
+        size_t nr;
+        char name[SYMBOL_NAME_CAP];
+
+        if (sscanf(line, "line x%x %zu", &addr, &nr) == 2) {
+            syms->lines[(u16) addr] = nr;
+        } else if (sscanf(line, "label x%x %63s", &addr, name) == 2) {
+            if (syms->size == syms->cap) {
+                syms->cap = syms->cap ? syms->cap * 2 : 64;
+                syms->buf = realloc(syms->buf,
+                        syms->cap * sizeof(struct symbol));
+                if (syms->buf == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            struct symbol *s = syms->buf + syms->size++;
+            s->addr = addr;
+            memcpy(s->name, name, sizeof(name));
+        }
+    }
+
+    fclose(f);
+    qsort(syms->buf, syms->size, sizeof(struct symbol), symbol_cmp);
+    return syms;
+}
+
+// @NOTE(art): `label+offset (line N)` of the closest label at or before addr
+static void print_where(FILE *out, struct symbols *syms, u16 addr)
+{
+    if (syms == NULL) return;
+
+    struct symbol *found = NULL;
+    size_t lo = 0, hi = syms->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (syms->buf[mid].addr <= addr) {
+            found = syms->buf + mid;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (found != NULL) fprintf(out, "  %s+%u", found->name, addr - found->addr);
+    if (syms->lines[addr]) fprintf(out, " (line %zu)", syms->lines[addr]);
+}
+
+static int ends_block(u16 inst)
+{
+    switch (inst >> 12) {
+    case OP_BR:
+    case OP_JMP:
+    case OP_JSR:
+    case OP_RTI:
+    case OP_TRAP:
+    case OP_RESERVED:
+        return 1;
+    }
+    return 0;
+}
+
+static void report_addresses(FILE *out, struct lc3_profile *p,
+        struct symbols *syms, struct hot *hot, size_t total)
+{
+    size_t size = 0;
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) {
+        if (p->count[pc] == 0) continue;
+        hot[size++] = (struct hot) {
+            .addr = pc,
+            .end = pc,
+            .weight = p->count[pc]
+        };
+    }
+    qsort(hot, size, sizeof(struct hot), hot_cmp);
+
+    fprintf(out, "\nhot addresses\n");
+    for (size_t i = 0; i < size && i < REPORT_TOP; ++i) {
+        fprintf(out, "  x%04X %12zu %5.1f%%", hot[i].addr, hot[i].weight,
+                100.0 * hot[i].weight / total);
+        print_where(out, syms, hot[i].addr);
+        fprintf(out, "\n");
+    }
+}
+
+// @NOTE(art): blocks are rebuilt from counts. Block starts after a control
+// transfer, at a taken branch or JSR target, or where count changes (someone
+// jumped in through JMP/JSRR/RET).
+static void report_blocks(FILE *out, struct lc3_vm *vm,
+        struct lc3_profile *p, struct symbols *syms, struct hot *hot,
+        size_t total)
+{
+    u16 *memory = vm->memory;
+
+    // @LEAK(art): let OS free it
+    unsigned char *target = calloc(MEMORY_CAP, sizeof(unsigned char));
+    if (target == NULL) {
+        perror("calloc");
+        return;
+    }
+
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) {
+        if (p->count[pc] == 0) continue;
+        u16 inst = memory[pc];
+        u16 next_pc = pc + 1;
+        if (inst >> 12 == OP_BR && p->taken[pc]) {
+            target[(u16) (next_pc + sext(inst & 0x1FF, 9))] = 1;
+        } else if (inst >> 12 == OP_JSR && (inst >> 11 & 0x1)) {
+            target[(u16) (next_pc + sext(inst & 0x7FF, 11))] = 1;
+        }
+    }
+
+    size_t size = 0;
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) {
+        if (p->count[pc] == 0) continue;
+
+        int is_leader = size == 0 || hot[size - 1].end != pc - 1 ||
+            ends_block(memory[pc - 1]) || target[pc] ||
+            p->count[pc] != p->count[pc - 1];
+
+        if (is_leader) {
+            hot[size++] = (struct hot) {
+                .addr = pc,
+                .end = pc,
+                .weight = 0
+            };
+        }
+
+        hot[size - 1].end = pc;
+        hot[size - 1].weight += p->count[pc];
+    }
+    qsort(hot, size, sizeof(struct hot), hot_cmp);
+
+    fprintf(out, "\nhot blocks\n");
+    for (size_t i = 0; i < size && i < REPORT_TOP; ++i) {
+        struct hot *h = hot + i;
+        fprintf(out, "  x%04X-x%04X %4u inst %12zu entries %5.1f%%",
+                h->addr, h->end, h->end - h->addr + 1, p->count[h->addr],
+                100.0 * h->weight / total);
+        print_where(out, syms, h->addr);
+        fprintf(out, "\n");
+    }
+}
+
+static void report_loops(FILE *out, struct lc3_vm *vm,
+        struct lc3_profile *p, struct symbols *syms, struct hot *hot)
+{
+    size_t size = 0;
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) {
+        u16 inst = vm->memory[pc];
+        if (inst >> 12 != OP_BR || p->taken[pc] == 0) continue;
+
+        u16 target = pc + 1 + sext(inst & 0x1FF, 9);
+        if (target > pc) continue;
+
+        hot[size++] = (struct hot) {
+            .addr = pc,
+            .end = target,
+            .weight = p->taken[pc]
+        };
+    }
+    qsort(hot, size, sizeof(struct hot), hot_cmp);
+
+    fprintf(out, "\nloop back-edges\n");
+    for (size_t i = 0; i < size && i < REPORT_TOP; ++i) {
+        struct hot *h = hot + i;
+        size_t exits = p->count[h->addr] - h->weight;
+        fprintf(out, "  x%04X -> x%04X %12zu taken %12zu not taken",
+                h->addr, h->end, h->weight, exits);
+        if (exits > 0) {
+            fprintf(out, " %10.1f trips", (double) h->weight / exits);
+        }
+        print_where(out, syms, h->end);
+        fprintf(out, "\n");
+    }
+}
+
+// @NOTE(art): instruction forms for fusion discovery, opcode split the same
+// way as handlers in vm.c (immediate ADD/AND, JSRR, BR by nzp)
+static size_t form_of(u16 inst)
+{
+    switch (inst >> 12) {
+    case OP_ADD: return inst >> 5 & 0x1 ? 16 : OP_ADD;
+    case OP_AND: return inst >> 5 & 0x1 ? 17 : OP_AND;
+    case OP_JSR: return inst >> 11 & 0x1 ? OP_JSR : 18;
+    case OP_BR: return 24 + (inst >> 9 & 0x7);
+    }
+    return inst >> 12;
+}
+
+static const char *form_names[FORMS] = {
+    [OP_ADD] = "ADD", [OP_LD] = "LD", [OP_ST] = "ST", [OP_JSR] = "JSR",
+    [OP_AND] = "AND", [OP_LDR] = "LDR", [OP_STR] = "STR", [OP_RTI] = "RTI",
+    [OP_NOT] = "NOT", [OP_LDI] = "LDI", [OP_STI] = "STI", [OP_JMP] = "JMP",
+    [OP_RESERVED] = "RES", [OP_LEA] = "LEA", [OP_TRAP] = "TRAP",
+    [16] = "ADD#", [17] = "AND#", [18] = "JSRR",
+    [24] = "NOP", [25] = "BRp", [26] = "BRz", [27] = "BRzp", [28] = "BRn",
+    [29] = "BRnp", [30] = "BRnz", [31] = "BRnzp"
+};
+
+// @NOTE(art): sequence runs as a whole every time its first instructions
+// fall through, so a pair is weighted by count of its head and a triple the
+// same, when neither of the first ones ends a block. Dispatches saved by
+// fusing is weight * (length - 1); `fused` is the share vm.c already fuses.
+static void report_sequences(FILE *out, struct lc3_vm *vm,
+        struct lc3_profile *p, struct hot *hot, size_t total)
+{
+    // @NOTE(art): pairs are FORMS * FORMS first, triples after them, index
+    // fits hot's addr
+    struct {
+        size_t weight[FORMS * FORMS + FORMS * FORMS * FORMS];
+        size_t fused[FORMS * FORMS + FORMS * FORMS * FORMS];
+    } *seqs = calloc(1, sizeof(*seqs));
+    if (seqs == NULL) {
+        perror("calloc");
+        return;
+    }
+
+    for (size_t pc = 0; pc + 2 < MEMORY_CAP; ++pc) {
+        u16 *w = vm->memory + pc;
+        if (p->count[pc] == 0 || ends_block(w[0])) continue;
+
+        size_t len = fuse_len(vm->memory, pc);
+        size_t pair = form_of(w[0]) * FORMS + form_of(w[1]);
+        seqs->weight[pair] += p->count[pc];
+        if (len == 2) seqs->fused[pair] += p->count[pc];
+
+        if (ends_block(w[1])) continue;
+        size_t triple = FORMS * FORMS + pair * FORMS + form_of(w[2]);
+        seqs->weight[triple] += p->count[pc];
+        if (len == 3) seqs->fused[triple] += p->count[pc];
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < FORMS * FORMS + FORMS * FORMS * FORMS; ++i) {
+        if (seqs->weight[i] == 0) continue;
+        size_t saved = seqs->weight[i] * (i < FORMS * FORMS ? 1 : 2);
+        hot[size++] = (struct hot) {.addr = i, .weight = saved};
+    }
+    qsort(hot, size, sizeof(struct hot), hot_cmp);
+
+    fprintf(out, "\nfusion candidates (dispatches saved)\n");
+    for (size_t i = 0; i < size && i < REPORT_TOP; ++i) {
+        size_t seq = hot[i].addr;
+        char name[32];
+        if (seq < FORMS * FORMS) {
+            snprintf(name, sizeof(name), "%s %s", form_names[seq / FORMS],
+                    form_names[seq % FORMS]);
+        } else {
+            size_t t = seq - FORMS * FORMS;
+            snprintf(name, sizeof(name), "%s %s %s",
+                    form_names[t / FORMS / FORMS],
+                    form_names[t / FORMS % FORMS], form_names[t % FORMS]);
+        }
+        fprintf(out, "  %-18s %12zu %5.1f%% fused %5.1f%%\n", name,
+                hot[i].weight, 100.0 * hot[i].weight / total,
+                100.0 * seqs->fused[seq] / seqs->weight[seq]);
+    }
+    free(seqs);
+}
+
+// @NOTE(art): how much decode state the executed code touches, to weigh
+// per-address predecode (indexed by PC, one copy per machine) against the
+// word table (indexed by instruction word, shared). Words are taken from
+// memory after the run, so code written at runtime counts as final version.
+static void report_decode(FILE *out, struct lc3_vm *vm,
+        struct lc3_profile *p)
+{
+    struct {
+        unsigned char word[MEMORY_CAP];
+        unsigned char addr_line[DECODE_LINES];
+        unsigned char word_line[DECODE_LINES];
+    } *seen = calloc(1, sizeof(*seen));
+    if (seen == NULL) {
+        perror("calloc");
+        return;
+    }
+
+    size_t addrs = 0, words = 0, addr_lines = 0, word_lines = 0;
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) {
+        if (p->count[pc] == 0) continue;
+        u16 word = vm->memory[pc];
+        size_t addr_line = pc * sizeof(struct lc3_decoded) / CACHE_LINE;
+        size_t word_line = word * sizeof(struct lc3_decoded) / CACHE_LINE;
+
+        addrs++;
+        words += !seen->word[word];
+        addr_lines += !seen->addr_line[addr_line];
+        word_lines += !seen->word_line[word_line];
+        seen->word[word] = seen->addr_line[addr_line] = 1;
+        seen->word_line[word_line] = 1;
+    }
+
+    fprintf(out, "\ndecode footprint (%zu byte entries, %d byte lines)\n",
+            sizeof(struct lc3_decoded), CACHE_LINE);
+    fprintf(out, "  per address %6zu addresses %6zu lines %7zu bytes\n",
+            addrs, addr_lines, addr_lines * CACHE_LINE);
+    fprintf(out, "  word table  %6zu words     %6zu lines %7zu bytes\n",
+            words, word_lines, word_lines * CACHE_LINE);
+    free(seen);
+}
+
+void lc3_profile_report(struct lc3_vm *vm, struct lc3_profile *p,
+        const char *sym_path, FILE *out)
+{
+    size_t total = 0;
+    for (size_t pc = 0; pc < MEMORY_CAP; ++pc) total += p->count[pc];
+    if (total == 0) return;
+
+    // @LEAK(art): let OS free it
+    struct symbols *syms = sym_path ? read_symbols(sym_path) : NULL;
+    struct hot *hot = malloc(MEMORY_CAP * sizeof(struct hot));
+    if (hot == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    fprintf(out, "profile: %zu instructions\n", total);
+    report_addresses(out, p, syms, hot, total);
+    report_blocks(out, vm, p, syms, hot, total);
+    report_loops(out, vm, p, syms, hot);
+    report_sequences(out, vm, p, hot, total);
+    report_decode(out, vm, p);
+
+    free(hot);
+}
@@ -0,0 +1,1017 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lc3.h"
+
+u16 sext(u16 value, size_t bit_len)
+{
+    if (value >> (bit_len - 1) & 0x1) {
+        return 0xFFFF << bit_len | value;
+    }
+
+    return value;
+}
+
+// @NOTE(art): N/Z/P of a value without branches: zero gives Z, sign bit N,
+// anything else P
+#define CC_OF(value) (1 << (((value) == 0) | ((value) >> 15) << 1))
+
+static void setcc(struct lc3_vm *vm, u16 value)
+{
+    u16 nzp;
+    if (value == 0) {
+        nzp = CC_Z;
+    } else if (value >> 15) {
+        nzp = CC_N;
+    } else {
+        nzp = CC_P;
+    }
+
+    vm->regs[R_PSR] = (vm->regs[R_PSR] & 0x8000) | nzp;
+}
+
+// @NOTE(art): handlers the interpreter dispatches on. Opcodes with forms are
+// split so handlers do not test mode bits: ADD/AND immediate and register,
+// JSRR and JSR, and BR gets one handler per nzp (H_BR_NEVER + nzp). Zero word
+// is BR never, so H_BR_NEVER must stay 0 (see lc3_vm_reset()). Last ones
+// are superinstructions (see fuse_len()).
+enum handler {
+    H_BR_NEVER, H_BR_P, H_BR_Z, H_BR_ZP, H_BR_N, H_BR_NP, H_BR_NZ, H_BR_ALWAYS,
+    H_ADD_REG, H_ADD_IMM, H_AND_REG, H_AND_IMM, H_NOT,
+    H_LD, H_LDI, H_LDR, H_LEA, H_ST, H_STI, H_STR,
+    H_JMP, H_JSRR, H_JSR, H_RTI, H_TRAP, H_RESERVED,
+    H_ADD_BR, H_CLR_ADD, H_LDR_ADD_STR,
+    H_COUNT
+};
+
+static const unsigned char op_handler[16] = {
+    [OP_BR] = H_BR_NEVER, [OP_ADD] = H_ADD_REG, [OP_LD] = H_LD,
+    [OP_ST] = H_ST, [OP_JSR] = H_JSRR, [OP_AND] = H_AND_REG,
+    [OP_LDR] = H_LDR, [OP_STR] = H_STR, [OP_RTI] = H_RTI, [OP_NOT] = H_NOT,
+    [OP_LDI] = H_LDI, [OP_STI] = H_STI, [OP_JMP] = H_JMP,
+    [OP_RESERVED] = H_RESERVED, [OP_LEA] = H_LEA, [OP_TRAP] = H_TRAP
+};
+
+static struct lc3_decoded decode_word(u16 inst)
+{
+    u16 opcode = inst >> 12;
+    struct lc3_decoded d = {
+        .handler = op_handler[opcode],
+        .dst = inst >> 9 & 0x7,
+        .src = inst >> 6 & 0x7
+    };
+
+    switch (opcode) {
+    case OP_ADD:
+    case OP_AND: {
+        int is_imm = inst >> 5 & 0x1;
+        d.handler += is_imm;
+        d.imm = is_imm ? sext(inst & 0x1F, 5) : (inst & 0x7);
+    } break;
+
+    case OP_BR:
+        d.handler += inst >> 9 & 0x7;
+        d.imm = sext(inst & 0x1FF, 9);
+        break;
+
+    case OP_JSR:
+        d.handler += inst >> 11 & 0x1;
+        d.imm = sext(inst & 0x7FF, 11);
+        break;
+
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+        d.imm = sext(inst & 0x1FF, 9);
+        break;
+
+    case OP_LDR:
+    case OP_STR:
+        d.imm = sext(inst & 0x3F, 6);
+        break;
+
+    case OP_TRAP:
+        d.imm = inst & 0xFF;
+        break;
+    }
+
+    return d;
+}
+
+#ifdef LC3_DECODE_TABLE
+// @NOTE(art): every possible word decoded once per process, exec() indexes
+// it with the fetched word, so stores and loads have nothing to redecode.
+// It is the only global state in vm.c and read only after it is built.
+static struct lc3_decoded word_table[MEMORY_CAP];
+static pthread_once_t word_table_once = PTHREAD_ONCE_INIT;
+
+static void build_word_table(void)
+{
+    for (size_t w = 0; w < MEMORY_CAP; ++w) word_table[w] = decode_word(w);
+}
+#endif
+
+// @NOTE(art): superinstructions, sequences compiled code is full of, run by
+// one handler: ADD imm then conditional BR (loop counter), AND #0 then ADD imm
+// to the same register (load constant) and LDR, ADD, STR of the same word
+// (read-modify-write). Returns how many words starting at addr fuse, 0 when
+// none. Only the head gets fused handler, the rest keep their own, so a jump
+// into the middle just runs them one by one. Loaded code is fused (see
+// load_image()), word table decodes words alone, so nothing is fused there.
+int fuse_len(const u16 *memory, u16 addr)
+{
+#ifdef LC3_DECODE_TABLE
+    (void) memory;
+    (void) addr;
+#else
+    if (addr > MEMORY_CAP - 3) return 0;
+
+    u16 a = memory[addr], b = memory[addr + 1], c = memory[addr + 2];
+    u16 a_dst = a >> 9 & 0x7, a_src = a >> 6 & 0x7;
+    int is_add_to_dst = b >> 12 == OP_ADD && (b >> 9 & 0x7) == a_dst
+        && (b >> 6 & 0x7) == a_dst;
+
+    switch (a >> 12) {
+    case OP_ADD:
+        if ((a >> 5 & 0x1) && b >> 12 == OP_BR && (b >> 9 & 0x7)) return 2;
+        break;
+
+    case OP_AND:
+        if ((a & 0x3F) == 0x20 && is_add_to_dst && (b >> 5 & 0x1)) return 2;
+        break;
+
+    case OP_LDR:
+        if (a_dst != a_src && is_add_to_dst && c >> 12 == OP_STR
+                && (c & 0xFFF) == (a & 0xFFF)) {
+            return 3;
+        }
+        break;
+    }
+#endif
+
+    return 0;
+}
+
+#ifndef LC3_DECODE_TABLE
+static void fuse(struct lc3_vm *vm, u16 addr)
+{
+    if (fuse_len(vm->memory, addr) == 0) return;
+
+    u16 opcode = vm->memory[addr] >> 12;
+    vm->decoded[addr].handler = opcode == OP_ADD ? H_ADD_BR
+        : opcode == OP_AND ? H_CLR_ADD : H_LDR_ADD_STR;
+}
+
+// @NOTE(art): word at addr can be inside a sequence fused up to two words
+// back, such head goes back to its plain handler. Code is fused only when
+// loaded, so stores (mostly data) do not pay for looking for sequences.
+static void decode(struct lc3_vm *vm, u16 addr)
+{
+    struct lc3_decoded *d = vm->decoded + addr;
+    *d = decode_word(vm->memory[addr]);
+
+    if (addr >= 1 && d[-1].handler >= H_ADD_BR) {
+        d[-1].handler = decode_word(vm->memory[addr - 1]).handler;
+    }
+    if (addr >= 2 && d[-2].handler >= H_ADD_BR) {
+        d[-2].handler = decode_word(vm->memory[addr - 2]).handler;
+    }
+}
+#endif
+
+// @NOTE(art): every store goes through here so code written at runtime gets
+// redecoded (word table needs nothing), and page is remembered for
+// lc3_vm_reset(). Storing the word that is already there changes nothing,
+// code patching itself in a loop often does that.
+static void mem_write(struct lc3_vm *vm, u16 addr, u16 value)
+{
+    if (vm->memory[addr] == value) return;
+
+    vm->memory[addr] = value;
+    vm->dirty[addr / MEMORY_PAGE] = DIRTY_ALL;
+#ifndef LC3_DECODE_TABLE
+    decode(vm, addr);
+#endif
+#ifdef LC3_JIT
+    jit_invalidate(vm->jit, addr);
+#endif
+}
+
+// @NOTE(art): console output goes to a big buffer and reaches the fd in
+// bulk. It is flushed when full, on newline if fd is a terminal, before
+// reading input and when machine stops.
+void lc3_vm_flush(struct lc3_vm *vm)
+{
+    size_t done = 0;
+    while (done < vm->out_size) {
+        ssize_t n = write(vm->out_fd, vm->out_buf + done, vm->out_size - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        done += n;
+    }
+    vm->out_size = 0;
+}
+
+void lc3_vm_set_output(struct lc3_vm *vm, int fd)
+{
+    lc3_vm_flush(vm);
+    vm->out_fd = fd;
+    vm->out_tty = isatty(fd);
+}
+
+static void out_char(struct lc3_vm *vm, char c)
+{
+    if (vm->out_size == OUT_CAP) lc3_vm_flush(vm);
+    vm->out_buf[vm->out_size++] = c;
+    if (c == '\n' && vm->out_tty) lc3_vm_flush(vm);
+}
+
+static int in_char(struct lc3_vm *vm)
+{
+    lc3_vm_flush(vm);
+    int c = fgetc(vm->in);
+    return c == EOF ? 0 : c & 0xFF;
+}
+
+// @NOTE(art): returns 1 when machine is halted
+int exec_trap(struct lc3_vm *vm, u16 trapvec8)
+{
+    u16 *regs = vm->regs;
+    u16 *memory = vm->memory;
+
+    switch (trapvec8) {
+    case 0x20:
+        regs[R_R0] = in_char(vm);
+        break;
+    case 0x21:
+        out_char(vm, regs[R_R0] & 0xFF);
+        break;
+    case 0x22:
+        for (u16 addr = regs[R_R0]; memory[addr] != '\0'; ++addr) {
+            out_char(vm, memory[addr] & 0xFF);
+        }
+        break;
+    case 0x23: {
+        const char *prompt = "\nInput a character> ";
+        while (*prompt) out_char(vm, *prompt++);
+        regs[R_R0] = in_char(vm);
+        if (regs[R_R0]) out_char(vm, regs[R_R0]);
+    } break;
+    case 0x24:
+        // @NOTE(art): two chars per word, low byte first
+        for (u16 addr = regs[R_R0]; memory[addr] != '\0'; ++addr) {
+            out_char(vm, memory[addr] & 0xFF);
+            if (memory[addr] >> 8) out_char(vm, memory[addr] >> 8);
+        }
+        break;
+    case 0x25: {
+        const char *msg = "lc3 is halted\n";
+        while (*msg) out_char(vm, *msg++);
+        lc3_vm_flush(vm);
+    } return 1;
+    }
+
+    return 0;
+}
+
+void exec_rti(struct lc3_vm *vm)
+{
+    u16 *regs = vm->regs;
+
+    regs[R_PC] = vm->memory[regs[R_R6]];
+    regs[R_R6]++;
+    regs[R_PSR] = vm->memory[regs[R_R6]];
+    regs[R_R6]++;
+}
+
+// @NOTE(art): checkpoint file is mapped and has two slots written in turn,
+// so when process dies in the middle of writing one, the other is whole.
+// Slot with bigger `seq` is the newer one (0 is never written), `seq` is
+// stored last. Words and counters are in host order, file is only for the
+// machine that wrote it. Nothing is synced, file survives the process, not
+// the OS going down.
+#define CHECKPOINT_MAGIC 0x4B43334Cu
+
+struct checkpoint_slot {
+    size_t seq;
+    size_t instret;
+    long in_offset;
+    u16 regs[R_COUNT];
+    u16 memory[MEMORY_CAP];
+};
+
+struct checkpoint_file {
+    unsigned magic;
+    unsigned size;
+    struct checkpoint_slot slots[2];
+};
+
+// @NOTE(art): `stale` has bit per slot, page changed since the slot got it
+struct lc3_checkpoint {
+    struct checkpoint_file *file;
+    size_t every;
+    size_t next;
+    size_t seq;
+    unsigned char stale[MEMORY_PAGES];
+};
+
+// @NOTE(art): only pages changed since this slot was written are copied, so
+// one checkpoint is at most a copy of memory, every `every` instructions.
+// `instret` is count with what runner did not add to vm->instret yet.
+static void checkpoint_write(struct lc3_vm *vm, size_t instret)
+{
+    struct lc3_checkpoint *c = vm->checkpoint;
+    int k = (c->seq + 1) % 2;
+    struct checkpoint_slot *s = c->file->slots + k;
+
+    lc3_vm_flush(vm);
+
+    for (size_t p = 0; p < MEMORY_PAGES; ++p) {
+        if (vm->dirty[p] & DIRTY_CHECKPOINT) {
+            vm->dirty[p] &= ~DIRTY_CHECKPOINT;
+            c->stale[p] = 0x3;
+        }
+        if (!(c->stale[p] & 1 << k)) continue;
+
+        memcpy(s->memory + p * MEMORY_PAGE, vm->memory + p * MEMORY_PAGE,
+                MEMORY_PAGE * sizeof(*vm->memory));
+        c->stale[p] &= ~(1 << k);
+    }
+
+    memcpy(s->regs, vm->regs, sizeof(s->regs));
+    s->instret = instret;
+    s->in_offset = ftell(vm->in);
+    __atomic_store_n(&s->seq, ++c->seq, __ATOMIC_RELEASE);
+
+    c->next = instret + c->every;
+}
+
+void lc3_vm_checkpoint(struct lc3_vm *vm)
+{
+    if (vm->checkpoint == NULL) return;
+
+    checkpoint_write(vm, vm->instret);
+    vm->check_at = 0;
+}
+
+#define CLOCK_CHUNK (1 << 20)
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// @NOTE(art): 0 is no limit. Both count from this call.
+void lc3_vm_set_limits(struct lc3_vm *vm, size_t max_instret,
+        long max_wall_ms)
+{
+    vm->max_instret = max_instret > 0 ? vm->instret + max_instret : 0;
+    vm->deadline = max_wall_ms > 0 ? now_ns() + max_wall_ms * 1000000ll : 0;
+    vm->check_at = 0;
+}
+
+// @NOTE(art): limits are not checked per instruction. Runners only call
+// this once their count reaches `check_at` (where blocks end, so straight
+// line code pays nothing), which is the instruction budget, the next time
+// to read the clock, every CLOCK_CHUNK instructions, or the next checkpoint,
+// whichever comes first. Registers and PSR have to be up to date.
+// `instret` is retired instructions not added to vm->instret yet.
+int check_limits(struct lc3_vm *vm, size_t instret)
+{
+    size_t total = vm->instret + instret;
+    if (vm->max_instret && total >= vm->max_instret) {
+        return LC3_OUT_OF_INSTRUCTIONS;
+    }
+    if (vm->deadline && now_ns() >= vm->deadline) return LC3_OUT_OF_TIME;
+
+    struct lc3_checkpoint *c = vm->checkpoint;
+    if (c != NULL && total >= c->next) checkpoint_write(vm, total);
+
+    vm->check_at = vm->max_instret ? vm->max_instret : SIZE_MAX;
+    if (vm->deadline && total + CLOCK_CHUNK < vm->check_at) {
+        vm->check_at = total + CLOCK_CHUNK;
+    }
+    if (c != NULL && c->next < vm->check_at) vm->check_at = c->next;
+    return LC3_RUNNING;
+}
+
+// @NOTE(art): two dispatch engines share the handler bodies below. Default is
+// a portable switch; with LC3_THREADED every handler jumps straight to the
+// next one through a table of label addresses (GCC labels as values), so each
+// handler gets its own indirect branch to predict.
+// NEXT is `continue` inside do/while for the switch; threaded single step
+// swaps in a table where every entry leads back out of the function.
+// Decoded instruction comes from per-address cache, or with LC3_DECODE_TABLE
+// from the word table indexed by the instruction itself.
+#ifdef LC3_DECODE_TABLE
+#define DECODED(pc) (word_table + memory[pc])
+#else
+#define DECODED(pc) (decoded + (pc))
+#endif
+
+#ifdef LC3_THREADED
+#define CASE(h) h_##h:
+#define FETCH (instret++, d = DECODED(regs[R_PC]++))
+#define NEXT goto *next[FETCH->handler]
+#define REDISPATCH goto *dispatch[d->handler]
+#else
+#define CASE(h) case h:
+#define NEXT continue
+#define REDISPATCH goto redispatch
+#endif
+
+// @NOTE(art): single step runs fused head as the plain instruction, so
+// stepping (and profiler on top of it) still sees one instruction at a time
+#define UNFUSE_IF_SINGLE() if (single) {                    \
+    unfused = decode_word(memory[regs[R_PC] - 1]);          \
+    d = &unfused;                                           \
+    REDISPATCH;                                             \
+}
+
+// @NOTE(art): condition codes are lazy inside exec(). Instructions only
+// remember the last result, N/Z/P is worked out when BR asks for it, and
+// written to PSR once when we leave. After RTI, PSR is the source again.
+// Retired instructions are counted in a local the same way.
+#define SETCC(value) (cc_value = (value), cc_lazy = 1)
+#define LEAVE() do {                        \
+    if (cc_lazy) setcc(vm, cc_value);       \
+    vm->instret += instret;                 \
+} while (0)
+
+// @NOTE(art): control transfers end blocks, limits are looked at there.
+// Checkpoint may be taken, so condition codes go to PSR first.
+#define BLOCK_END() do {                                        \
+    if (instret >= check_at) {                                  \
+        if (cc_lazy) setcc(vm, cc_value);                       \
+        cc_lazy = 0;                                            \
+        int status = check_limits(vm, instret);                 \
+        if (status != LC3_RUNNING) {                            \
+            LEAVE();                                            \
+            return status;                                      \
+        }                                                       \
+        check_at = vm->check_at - vm->instret;                  \
+    }                                                           \
+} while (0)
+
+#define BRANCH(nzp_mask) {                                      \
+    u16 nzp = cc_lazy ? CC_OF(cc_value) : regs[R_PSR];          \
+    if (nzp & (nzp_mask)) regs[R_PC] += d->imm;                 \
+    BLOCK_END();                                                \
+} NEXT
+
+// @NOTE(art): runs until HALT, illegal opcode or a limit, or just one
+// instruction when `single` is set. Returns enum lc3_status.
+static int exec(struct lc3_vm *vm, int single)
+{
+    u16 *regs = vm->regs;
+    u16 *memory = vm->memory;
+#ifndef LC3_DECODE_TABLE
+    struct lc3_decoded *decoded = vm->decoded;
+    struct lc3_decoded unfused;
+#endif
+    struct lc3_decoded *d;
+    u16 cc_value = 0;
+    int cc_lazy = 0;
+    size_t instret = 0;
+    size_t check_at = vm->check_at > vm->instret
+        ? vm->check_at - vm->instret : 0;
+
+#ifdef LC3_THREADED
+    // @NOTE(art): labels as values and `goto *` are GCC extensions, keep
+    // -Wpedantic quiet for the dispatch table and the handlers below only.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static void *dispatch[H_COUNT] = {
+        [H_BR_NEVER] = &&h_H_BR_NEVER,
+        [H_BR_P] = &&h_H_BR_P,
+        [H_BR_Z] = &&h_H_BR_Z,
+        [H_BR_ZP] = &&h_H_BR_ZP,
+        [H_BR_N] = &&h_H_BR_N,
+        [H_BR_NP] = &&h_H_BR_NP,
+        [H_BR_NZ] = &&h_H_BR_NZ,
+        [H_BR_ALWAYS] = &&h_H_BR_ALWAYS,
+        [H_ADD_REG] = &&h_H_ADD_REG,
+        [H_ADD_IMM] = &&h_H_ADD_IMM,
+        [H_AND_REG] = &&h_H_AND_REG,
+        [H_AND_IMM] = &&h_H_AND_IMM,
+        [H_NOT] = &&h_H_NOT,
+        [H_LD] = &&h_H_LD,
+        [H_LDI] = &&h_H_LDI,
+        [H_LDR] = &&h_H_LDR,
+        [H_LEA] = &&h_H_LEA,
+        [H_ST] = &&h_H_ST,
+        [H_STI] = &&h_H_STI,
+        [H_STR] = &&h_H_STR,
+        [H_JMP] = &&h_H_JMP,
+        [H_JSRR] = &&h_H_JSRR,
+        [H_JSR] = &&h_H_JSR,
+        [H_RTI] = &&h_H_RTI,
+        [H_TRAP] = &&h_H_TRAP,
+        [H_RESERVED] = &&h_H_RESERVED,
+#ifndef LC3_DECODE_TABLE
+        [H_ADD_BR] = &&h_H_ADD_BR,
+        [H_CLR_ADD] = &&h_H_CLR_ADD,
+        [H_LDR_ADD_STR] = &&h_H_LDR_ADD_STR
+#endif
+    };
+    static void *step[H_COUNT] = {
+        [0 ... H_COUNT - 1] = &&step_done
+    };
+    void **next = single ? step : dispatch;
+
+    goto *dispatch[FETCH->handler];
+
+step_done:
+    regs[R_PC]--;
+    instret--;
+    LEAVE();
+    return LC3_RUNNING;
+
+#else
+    do {
+        instret++;
+        d = DECODED(regs[R_PC]++);
+#ifndef LC3_DECODE_TABLE
+redispatch:
+#endif
+        switch (d->handler) {
+#endif
+        CASE(H_ADD_REG)
+            regs[d->dst] = regs[d->src] + regs[d->imm];
+            SETCC(regs[d->dst]);
+            NEXT;
+
+        CASE(H_ADD_IMM)
+            regs[d->dst] = regs[d->src] + d->imm;
+            SETCC(regs[d->dst]);
+            NEXT;
+
+        CASE(H_AND_REG)
+            regs[d->dst] = regs[d->src] & regs[d->imm];
+            SETCC(regs[d->dst]);
+            NEXT;
+
+        CASE(H_AND_IMM)
+            regs[d->dst] = regs[d->src] & d->imm;
+            SETCC(regs[d->dst]);
+            NEXT;
+
+        CASE(H_BR_NEVER)
+            BLOCK_END();
+            NEXT;
+
+        CASE(H_BR_P) BRANCH(CC_P);
+        CASE(H_BR_Z) BRANCH(CC_Z);
+        CASE(H_BR_ZP) BRANCH(CC_Z | CC_P);
+        CASE(H_BR_N) BRANCH(CC_N);
+        CASE(H_BR_NP) BRANCH(CC_N | CC_P);
+        CASE(H_BR_NZ) BRANCH(CC_N | CC_Z);
+
+        CASE(H_BR_ALWAYS) BRANCH(CC_N | CC_Z | CC_P);
+
+        CASE(H_JMP)
+            regs[R_PC] = regs[d->src];
+            BLOCK_END();
+            NEXT;
+
+        CASE(H_JSR)
+            regs[R_R7] = regs[R_PC];
+            regs[R_PC] += d->imm;
+            BLOCK_END();
+            NEXT;
+
+        CASE(H_JSRR) {
+            u16 base = regs[d->src];
+            regs[R_R7] = regs[R_PC];
+            regs[R_PC] = base;
+            BLOCK_END();
+        } NEXT;
+
+        CASE(H_LD) {
+            u16 addr = regs[R_PC] + d->imm;
+            regs[d->dst] = memory[addr];
+            SETCC(regs[d->dst]);
+        } NEXT;
+
+        CASE(H_LDI) {
+            u16 addr = regs[R_PC] + d->imm;
+            regs[d->dst] = memory[memory[addr]];
+            SETCC(regs[d->dst]);
+        } NEXT;
+
+        CASE(H_LDR) {
+            u16 addr = regs[d->src] + d->imm;
+            regs[d->dst] = memory[addr];
+            SETCC(regs[d->dst]);
+        } NEXT;
+
+        CASE(H_LEA)
+            regs[d->dst] = regs[R_PC] + d->imm;
+            NEXT;
+
+        CASE(H_NOT)
+            regs[d->dst] = ~regs[d->src];
+            SETCC(regs[d->dst]);
+            NEXT;
+
+        CASE(H_RTI)
+            cc_lazy = 0;
+            exec_rti(vm);
+            BLOCK_END();
+            NEXT;
+
+        CASE(H_ST) {
+            u16 addr = regs[R_PC] + d->imm;
+            mem_write(vm, addr, regs[d->dst]);
+        } NEXT;
+
+        CASE(H_STI) {
+            u16 addr = regs[R_PC] + d->imm;
+            mem_write(vm, memory[addr], regs[d->dst]);
+        } NEXT;
+
+        CASE(H_STR) {
+            u16 addr = regs[d->src] + d->imm;
+            mem_write(vm, addr, regs[d->dst]);
+        } NEXT;
+
+        CASE(H_TRAP)
+            if (exec_trap(vm, d->imm)) {
+                LEAVE();
+                return LC3_HALTED;
+            }
+            BLOCK_END();
+            NEXT;
+
+        CASE(H_RESERVED)
+            regs[R_PC]--;
+            instret--;
+            LEAVE();
+            return LC3_ILLEGAL;
+
+#ifndef LC3_DECODE_TABLE
+        CASE(H_ADD_BR) {
+            UNFUSE_IF_SINGLE();
+            u16 value = regs[d->src] + d->imm;
+            regs[d->dst] = value;
+            SETCC(value);
+            instret++;
+            regs[R_PC]++;
+            if (CC_OF(value) & (d[1].handler - H_BR_NEVER)) {
+                regs[R_PC] += d[1].imm;
+            }
+            BLOCK_END();
+        } NEXT;
+
+        CASE(H_CLR_ADD)
+            UNFUSE_IF_SINGLE();
+            regs[d->dst] = d[1].imm;
+            SETCC(regs[d->dst]);
+            instret++;
+            regs[R_PC]++;
+            NEXT;
+
+        CASE(H_LDR_ADD_STR) {
+            UNFUSE_IF_SINGLE();
+            u16 addr = regs[d->src] + d->imm;
+            regs[d->dst] = memory[addr];
+            regs[d->dst] += d[1].handler == H_ADD_IMM ? d[1].imm
+                : regs[d[1].imm];
+            SETCC(regs[d->dst]);
+            mem_write(vm, addr, regs[d->dst]);
+            instret += 2;
+            regs[R_PC] += 2;
+        } NEXT;
+#endif
+#ifdef LC3_THREADED
+#pragma GCC diagnostic pop
+#else
+        }
+    } while (!single);
+
+    LEAVE();
+    return LC3_RUNNING;
+#endif
+}
+
+struct lc3_vm *lc3_vm_create(void)
+{
+    struct lc3_vm *vm = calloc(1, sizeof(*vm));
+    if (vm == NULL) return NULL;
+
+    vm->in = stdin;
+    lc3_vm_set_output(vm, STDOUT_FILENO);
+
+#ifdef LC3_DECODE_TABLE
+    pthread_once(&word_table_once, build_word_table);
+#endif
+
+#ifdef LC3_JIT
+    if ((vm->jit = jit_create()) == NULL) {
+        free(vm);
+        return NULL;
+    }
+#endif
+
+    return vm;
+}
+
+void lc3_vm_destroy(struct lc3_vm *vm)
+{
+    if (vm->checkpoint != NULL) {
+        munmap(vm->checkpoint->file, sizeof(*vm->checkpoint->file));
+        free(vm->checkpoint);
+    }
+#ifdef LC3_JIT
+    jit_destroy(vm->jit);
+#endif
+    free(vm);
+}
+
+// @NOTE(art): only pages touched since last reset are cleared, zeroed decoded
+// entry is the same as decoded zero word, so both are just memset. Cleared
+// page is still a change for the checkpoint.
+void lc3_vm_reset(struct lc3_vm *vm)
+{
+    memset(vm->regs, 0, sizeof(vm->regs));
+    vm->instret = 0;
+    vm->check_at = 0;
+    vm->out_size = 0;
+    vm->snapshot = NULL;
+
+    for (size_t p = 0; p < MEMORY_PAGES; ++p) {
+        if (!(vm->dirty[p] & DIRTY_RESET)) continue;
+
+        memset(vm->memory + p * MEMORY_PAGE, 0,
+                MEMORY_PAGE * sizeof(*vm->memory));
+#ifndef LC3_DECODE_TABLE
+        memset(vm->decoded + p * MEMORY_PAGE, 0,
+                MEMORY_PAGE * sizeof(*vm->decoded));
+#endif
+        vm->dirty[p] = DIRTY_CHECKPOINT;
+    }
+
+#ifdef LC3_JIT
+    jit_flush(vm->jit);
+#endif
+}
+
+// @NOTE(art): output is flushed first, so pending output is not part of
+// the state. Input position is kept when `in` can seek.
+void lc3_vm_snapshot(struct lc3_vm *vm, struct lc3_snapshot *s)
+{
+    lc3_vm_flush(vm);
+
+    memcpy(s->regs, vm->regs, sizeof(s->regs));
+    memcpy(s->memory, vm->memory, sizeof(s->memory));
+#ifndef LC3_DECODE_TABLE
+    memcpy(s->decoded, vm->decoded, sizeof(s->decoded));
+#endif
+    for (size_t p = 0; p < MEMORY_PAGES; ++p) {
+        s->dirty[p] = vm->dirty[p] & DIRTY_RESET;
+        vm->dirty[p] &= ~DIRTY_SNAPSHOT;
+    }
+    s->instret = vm->instret;
+    s->in_offset = ftell(vm->in);
+    s->owner = vm;
+    vm->snapshot = s;
+}
+
+// @NOTE(art): only pages written since `s` was taken or last restored are
+// copied back (decoded entries with them), every page when machine last
+// saw another snapshot or `s` was taken again by another machine since.
+// Output not flushed yet is dropped.
+void lc3_vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *s)
+{
+    int is_full = vm->snapshot != s || s->owner != vm;
+
+    for (size_t p = 0; p < MEMORY_PAGES; ++p) {
+        if (!is_full && !(vm->dirty[p] & DIRTY_SNAPSHOT)) continue;
+
+        memcpy(vm->memory + p * MEMORY_PAGE, s->memory + p * MEMORY_PAGE,
+                MEMORY_PAGE * sizeof(*vm->memory));
+#ifndef LC3_DECODE_TABLE
+        memcpy(vm->decoded + p * MEMORY_PAGE, s->decoded + p * MEMORY_PAGE,
+                MEMORY_PAGE * sizeof(*vm->decoded));
+#endif
+        vm->dirty[p] = s->dirty[p] | DIRTY_CHECKPOINT;
+    }
+
+    memcpy(vm->regs, s->regs, sizeof(vm->regs));
+    vm->instret = s->instret;
+    vm->check_at = 0;
+    vm->out_size = 0;
+    if (s->in_offset >= 0) fseek(vm->in, s->in_offset, SEEK_SET);
+    vm->snapshot = s;
+
+#ifdef LC3_JIT
+    jit_flush(vm->jit);
+#endif
+}
+
+// @NOTE(art): copies `count` words (little endian ones from object files,
+// host order otherwise) to memory at `origin`, in bulk, then decodes and
+// fuses them. Image that runs past the end of memory is cut.
+static void load_image(struct lc3_vm *vm, u16 origin, const void *words,
+        size_t count, int is_le)
+{
+    if (count > (size_t) MEMORY_CAP - origin) count = MEMORY_CAP - origin;
+
+    u16 *dst = vm->memory + origin;
+    memcpy(dst, words, count * sizeof(u16));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; is_le && i < count; ++i) {
+        dst[i] = dst[i] << 8 | dst[i] >> 8;
+    }
+#else
+    (void) is_le;
+#endif
+
+#ifndef LC3_DECODE_TABLE
+    for (size_t i = 0; i < count; ++i) {
+        decode(vm, origin + i);
+    }
+    for (size_t a = origin < 2 ? 0 : origin - 2; a < origin + count; ++a) {
+        fuse(vm, a);
+    }
+#endif
+    if (count > 0) {
+        memset(vm->dirty + origin / MEMORY_PAGE, DIRTY_ALL,
+                (origin + count - 1) / MEMORY_PAGE - origin / MEMORY_PAGE + 1);
+    }
+
+#ifdef LC3_JIT
+    jit_flush(vm->jit);
+#endif
+}
+
+// @NOTE(art): object file is origin word followed by the image, all words
+// little endian. File is mapped, not read, so big images are one memcpy.
+int lc3_vm_load(struct lc3_vm *vm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < (off_t) sizeof(u16)) {
+        fprintf(stderr, "%s: missing origin\n", path);
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *obj = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (obj == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    u16 origin = obj[0] | obj[1] << 8;
+    vm->regs[R_PC] = origin;
+    load_image(vm, origin, obj + sizeof(u16), st.st_size / sizeof(u16) - 1,
+            1);
+
+    munmap(obj, st.st_size);
+    return 0;
+}
+
+// @NOTE(art): same layout as object file (origin first) but in host order,
+// straight from lc3_assemble()
+void lc3_vm_load_words(struct lc3_vm *vm, const u16 *words, size_t size)
+{
+    if (size == 0) return;
+
+    vm->regs[R_PC] = words[0];
+    load_image(vm, words[0], words + 1, size - 1, 0);
+}
+
+// @NOTE(art): file is created (or emptied) unless resuming, then machine
+// gets registers, instret, input position and memory of the newest slot,
+// memory is decoded and fused like a loaded image.
+int lc3_vm_checkpoint_open(struct lc3_vm *vm, const char *path, size_t every,
+        int is_resume)
+{
+    int fd = open(path, is_resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC,
+            0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    size_t size = sizeof(struct checkpoint_file);
+    if (is_resume && st.st_size != (off_t) size) {
+        fprintf(stderr, "%s: not a checkpoint\n", path);
+        close(fd);
+        return -1;
+    }
+    if (!is_resume && ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    struct checkpoint_file *file = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    struct lc3_checkpoint *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        perror("calloc");
+        munmap(file, size);
+        return -1;
+    }
+    c->file = file;
+    c->every = every;
+    memset(c->stale, 0x3, sizeof(c->stale));
+
+    if (!is_resume) {
+        file->magic = CHECKPOINT_MAGIC;
+        file->size = size;
+    } else {
+        struct checkpoint_slot *s = file->slots[1].seq > file->slots[0].seq
+            ? file->slots + 1 : file->slots;
+        if (file->magic != CHECKPOINT_MAGIC || file->size != size ||
+                s->seq == 0) {
+            fprintf(stderr, "%s: no checkpoint\n", path);
+            munmap(file, size);
+            free(c);
+            return -1;
+        }
+
+        load_image(vm, 0, s->memory, MEMORY_CAP, 0);
+        memcpy(vm->regs, s->regs, sizeof(vm->regs));
+        vm->instret = s->instret;
+        if (s->in_offset >= 0) fseek(vm->in, s->in_offset, SEEK_SET);
+
+        c->seq = s->seq;
+        memset(c->stale, 1 << (1 - s->seq % 2), sizeof(c->stale));
+        for (size_t p = 0; p < MEMORY_PAGES; ++p) {
+            vm->dirty[p] &= ~DIRTY_CHECKPOINT;
+        }
+    }
+
+    c->next = vm->instret + every;
+    vm->checkpoint = c;
+    vm->check_at = 0;
+    return 0;
+}
+
+// @NOTE(art): translated code stores straight to memory (see emit_store()
+// in jit.c) and leaves decoded entries behind, so with LC3_JIT the word at
+// PC is decoded again before it runs
+int lc3_vm_step(struct lc3_vm *vm)
+{
+#if defined(LC3_JIT) && !defined(LC3_DECODE_TABLE)
+    decode(vm, vm->regs[R_PC]);
+#endif
+    return exec(vm, 1);
+}
+
+int lc3_vm_run(struct lc3_vm *vm)
+{
+#ifdef LC3_JIT
+    int status = jit_run(vm);
+#else
+    int status = exec(vm, 0);
+#endif
+    lc3_vm_flush(vm);
+    return status;
+}